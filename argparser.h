@@ -6,13 +6,16 @@
 #include <cassert>
 #include <cstdlib>
 #include "vectors.h"
-#include "MersenneTwister.h"
+#include "triangle_buffer.h"
 
 // VISUALIZATION MODES FOR RADIOSITY
 #define NUM_RENDER_MODES 6
 enum RENDER_MODE { RENDER_MATERIALS, RENDER_RADIANCE, RENDER_FORM_FACTORS, 
 		   RENDER_LIGHTS, RENDER_UNDISTRIBUTED, RENDER_ABSORBED };
 
+// HOW RADIOSITY ITERATES: shoot the brightest patches (the default),
+// or sweep over all patches
+enum RADIOSITY_SWEEP { SWEEP_NONE, SWEEP_JACOBI, SWEEP_GAUSS_SEIDEL };
 
 // ======================================================================
 // Class to collect all the high-level rendering parameters controlled
@@ -40,6 +43,19 @@ public:
       } else if (!strcmp(argv[i],"-num_form_factor_samples")) {
 	i++; assert (i < argc); 
 	num_form_factor_samples = atoi(argv[i]);
+      } else if (!strcmp(argv[i],"-form_factor_threshold")) {
+	i++; assert (i < argc); 
+	form_factor_threshold = atof(argv[i]);
+	assert (form_factor_threshold >= 0 && form_factor_threshold < 1);
+      } else if (!strcmp(argv[i],"-num_shooters")) {
+	i++; assert (i < argc); 
+	num_shooters = atoi(argv[i]);
+	assert (num_shooters >= 1);
+      } else if (!strcmp(argv[i],"-radiosity_sweep")) {
+	i++; assert (i < argc); 
+	if (!strcmp(argv[i],"jacobi")) radiosity_sweep = SWEEP_JACOBI;
+	else if (!strcmp(argv[i],"gauss_seidel")) radiosity_sweep = SWEEP_GAUSS_SEIDEL;
+	else { printf ("unknown radiosity sweep '%s'\n",argv[i]); assert(0); }
       } else if (!strcmp(argv[i],"-sphere_rasterization")) {
 	i++; assert (i < argc); 
 	sphere_horiz = atoi(argv[i]);
@@ -56,6 +72,12 @@ public:
       } else if (!strcmp(argv[i],"-num_shadow_samples")) {
 	i++; assert (i < argc); 
 	num_shadow_samples = atoi(argv[i]);
+      } else if (!strcmp(argv[i],"-triangle_kernel")) {
+	i++; assert (i < argc); 
+	if (!strcmp(argv[i],"scalar")) triangle_kernel = TRIANGLE_KERNEL_SCALAR;
+	else if (!strcmp(argv[i],"sse")) triangle_kernel = TRIANGLE_KERNEL_SSE;
+	else if (!strcmp(argv[i],"avx2")) triangle_kernel = TRIANGLE_KERNEL_AVX2;
+	else { printf ("unknown triangle kernel '%s'\n",argv[i]); assert(0); }
       } else if (!strcmp(argv[i],"-num_antialias_samples")) {
 	i++; assert (i < argc); 
 	num_antialias_samples = atoi(argv[i]);
@@ -74,8 +96,28 @@ public:
       } else if (!strcmp(argv[i],"-num_photons_to_collect")) {
 	i++; assert (i < argc);
 	num_photons_to_collect = atoi(argv[i]);
+      } else if (!strcmp(argv[i],"-save_photon_map")) {
+	i++; assert (i < argc);
+	save_photon_map = argv[i];
+      } else if (!strcmp(argv[i],"-load_photon_map")) {
+	i++; assert (i < argc);
+	load_photon_map = argv[i];
       } else if (!strcmp(argv[i],"-gather_indirect")) {
 	gather_indirect = true;
+      } else if (!strcmp(argv[i],"-batch")) {
+	batch = true;
+      } else if (!strcmp(argv[i],"-coverage_report")) {
+	i++; assert (i < argc);
+	coverage_report = argv[i];
+	batch = true;
+      } else if (!strcmp(argv[i],"-no_scene_cache")) {
+	scene_cache = false;
+      } else if (!strcmp(argv[i],"-output")) {
+	i++; assert (i < argc);
+	output_file = argv[i];
+      } else if (!strcmp(argv[i],"-random_seed")) {
+	i++; assert (i < argc);
+	random_seed = atoi(argv[i]);
       } else {
 	printf ("whoops error with command line argument %d: '%s'\n",i,argv[i]);
 	assert(0);
@@ -90,12 +132,30 @@ public:
     height = 400;
     raytracing_animation = false;
     radiosity_animation = false;
+    // deterministic (repeatable) randomness
+    // (change the seed for different "real" randomness)
+    random_seed = 37;
+    // headless rendering (no OpenGL), the image is written to output_file
+    batch = false;
+    output_file = "output.ppm";
+    // headless photon shoot, writes the per-receiver coverage instead
+    coverage_report = NULL;
+    // read & write the parsed scene (and its BVH) as <input_file>.cache
+    scene_cache = true;
 
     // RADIOSITY PARAMETERS
     render_mode = RENDER_MATERIALS;
     interpolate = false;
     wireframe = false;
     num_form_factor_samples = 1;
+    // the smallest form factors of each row are dropped as long as
+    // they add up to at most this fraction of the row (0 keeps every
+    // non zero one)
+    form_factor_threshold = 0.01;
+    // patches (with the most undistributed light) shot per iteration
+    num_shooters = 1;
+    // iterations shoot the brightest patches, not whole sweeps
+    radiosity_sweep = SWEEP_NONE;
     sphere_horiz = 8;
     sphere_vert = 6;
     cylinder_ring_rasterization = 20; 
@@ -106,6 +166,8 @@ public:
     num_antialias_samples = 1;
     ambient_light = Vec3f(0.1,0.1,0.1);
     intersect_backfacing = false;
+    // the SIMD filter of the triangles (the best one the CPU supports)
+    triangle_kernel = TriangleBuffer::getKernel();
 
     // PHOTON MAPPING PARAMETERS
     render_photons = true;
@@ -113,6 +175,9 @@ public:
     num_photons_to_shoot = 10000;
     num_photons_to_collect = 100;
     gather_indirect = false;
+    // write the traced photons to this file / read them instead of tracing
+    save_photon_map = NULL;
+    load_photon_map = NULL;
     render_energy = false;
   }
 
@@ -126,12 +191,20 @@ public:
   int height;
   bool raytracing_animation;
   bool radiosity_animation;
+  int random_seed;
+  bool batch;
+  const char *output_file;
+  const char *coverage_report;
+  bool scene_cache;
 
   // RADIOSITY PARAMETERS
   enum RENDER_MODE render_mode;
   bool interpolate;
   bool wireframe;
   int num_form_factor_samples;
+  double form_factor_threshold;
+  int num_shooters;
+  enum RADIOSITY_SWEEP radiosity_sweep;
   int sphere_horiz;
   int sphere_vert;
   int cylinder_ring_rasterization;
@@ -142,6 +215,7 @@ public:
   int num_antialias_samples;
   Vec3f ambient_light;
   bool intersect_backfacing;
+  enum TRIANGLE_KERNEL triangle_kernel;
 
   // PHOTON MAPPING PARAMETERS
   int num_photons_to_shoot;
@@ -149,6 +223,8 @@ public:
   bool render_photons;
   bool render_kdtree;
   bool gather_indirect;
+  const char *save_photon_map;
+  const char *load_photon_map;
   bool render_energy;
 };
 
@@ -0,0 +1,358 @@
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#include "bvh.h"
+#include "mesh.h"
+#include "face.h"
+#include "primitive.h"
+#include "ray.h"
+#include "hit.h"
+#include "scene_cache.h"
+
+// leaves this small are never split
+#define BVH_MIN_ITEMS_PER_LEAF 2
+// leaves larger than this are always split, even if the SAH says not to
+#define BVH_MAX_ITEMS_PER_LEAF 16
+// number of bins per axis for the SAH evaluation
+#define BVH_NUM_BINS 16
+// cost of a traversal step relative to a ray/item intersection
+#define BVH_TRAVERSAL_COST 0.125
+// maximum depth of the tree (size of the traversal stack): nodes this
+// deep are always leaves
+#define BVH_MAX_DEPTH 128
+
+// ====================================================================
+// HELPER FUNCTIONS
+
+static double SurfaceArea(const BoundingBox &bb) {
+  Vec3f d = bb.getMax()-bb.getMin();
+  return 2*(d.x()*d.y() + d.y()*d.z() + d.z()*d.x());
+}
+
+// slab test of the ray against the node, within [0,max_t].  (The
+// exit distance gets a few ulps of slack for the round off of the
+// origin & inverse direction, which matters in single precision.)
+static bool IntersectNode(const BVHNode &node, const Vec3r &origin, const real *inv_direction, real max_t) {
+  real tmin = 0;
+  real tmax = max_t;
+  for (int k = 0; k < 3; k++) {
+    real t0 = (node.min[k] - origin[k]) * inv_direction[k];
+    real t1 = (node.max[k] - origin[k]) * inv_direction[k];
+    if (t0 > t1) std::swap(t0,t1);
+    tmin = std::max(tmin,t0);
+    tmax = std::min(tmax,t1);
+  }
+  return tmin <= tmax * (1 + 4*std::numeric_limits<real>::epsilon());
+}
+
+// the node bounds must contain the double precision boxes
+static real RoundDown(double v) {
+  real r = v;
+  return (r > v) ? nextafter(r,-std::numeric_limits<real>::max()) : r;
+}
+static real RoundUp(double v) {
+  real r = v;
+  return (r < v) ? nextafter(r,std::numeric_limits<real>::max()) : r;
+}
+
+static BoundingBox FaceBoundingBox(const Face *f) {
+  BoundingBox bb((*f)[0]->get());
+  bb.Extend((*f)[1]->get());
+  bb.Extend((*f)[2]->get());
+  bb.Extend((*f)[3]->get());
+  return bb;
+}
+
+// ====================================================================
+// CONSTRUCTION
+// ====================================================================
+
+BVH::BVH(Mesh *m) {
+  for (int i = 0; i < m->numOriginalQuads(); i++) {
+    items.push_back(BVHItem(BVH_ORIGINAL_QUAD,m->getOriginalQuad(i),NULL));
+  }
+  for (int i = 0; i < m->numRasterizedPrimitiveFaces(); i++) {
+    items.push_back(BVHItem(BVH_RASTERIZED_FACE,m->getRasterizedPrimitiveFace(i),NULL));
+  }
+  for (int i = 0; i < m->numPrimitives(); i++) {
+    items.push_back(BVHItem(BVH_PRIMITIVE,NULL,m->getPrimitive(i)));
+  }
+  if (items.empty()) return;
+  SceneCache *cache = m->getSceneCache();
+  std::vector<int> item_order;
+  if (cache != NULL && cache->getBVH(items.size(),nodes,item_order)) {
+    // the tree saved with the scene: just put the items in its order
+    std::vector<BVHItem> unordered(items);
+    for (unsigned int i = 0; i < items.size(); i++) {
+      items[i] = unordered[item_order[i]];
+    }
+  } else {
+    std::vector<BoundingBox> bounds;
+    std::vector<Vec3f> centroids;
+    for (unsigned int i = 0; i < items.size(); i++) {
+      if (items[i].face != NULL) bounds.push_back(FaceBoundingBox(items[i].face));
+      else bounds.push_back(items[i].prim->getBoundingBox());
+      centroids.push_back(bounds[i].getCenter());
+      // (the triangles aren't made yet: remember where each item was)
+      items[i].triangle = i;
+    }
+    nodes.reserve(2*items.size());
+    Build(bounds,centroids,0,items.size(),0);
+    if (cache != NULL) {
+      item_order.resize(items.size());
+      for (unsigned int i = 0; i < items.size(); i++) {
+        item_order[i] = items[i].triangle;
+      }
+      cache->setBVH(nodes,item_order);
+      cache->Save();
+    }
+  }
+  // flatten the faces, in the final item order
+  for (unsigned int i = 0; i < items.size(); i++) {
+    items[i].triangle = -1;
+    if (items[i].face != NULL) {
+      items[i].triangle = triangles.AddQuad(items[i].face);
+      triangle_items.push_back(i);
+      triangle_items.push_back(i);
+    }
+  }
+  for (unsigned int n = 0; n < nodes.size(); n++) {
+    if (!nodes[n].isLeaf()) continue;
+    nodes[n].first_triangle = -1;
+    nodes[n].num_triangles = 0;
+    for (int i = nodes[n].offset; i < nodes[n].offset+nodes[n].count; i++) {
+      if (items[i].face == NULL) continue;
+      if (nodes[n].first_triangle == -1) nodes[n].first_triangle = items[i].triangle;
+      nodes[n].num_triangles += 2;
+    }
+  }
+}
+
+int BVH::Build(std::vector<BoundingBox> &bounds, std::vector<Vec3f> &centroids, int first, int last, int depth) {
+  int index = nodes.size();
+  nodes.push_back(BVHNode());
+  int n = last-first;
+  assert (n > 0);
+
+  // the bounds of the items and of their centroids
+  BoundingBox node_bbox = bounds[first];
+  BoundingBox centroid_bbox(centroids[first]);
+  for (int i = first+1; i < last; i++) {
+    node_bbox.Extend(bounds[i]);
+    centroid_bbox.Extend(centroids[i]);
+  }
+  for (int k = 0; k < 3; k++) {
+    nodes[index].min[k] = RoundDown(node_bbox.getMin()[k]);
+    nodes[index].max[k] = RoundUp(node_bbox.getMax()[k]);
+  }
+  nodes[index].offset = first;
+  nodes[index].count = n;
+  nodes[index].axis = 0;
+  nodes[index].first_triangle = 0;
+  nodes[index].num_triangles = 0;
+  if (n <= BVH_MIN_ITEMS_PER_LEAF) return index;
+  // the traversal holds one pending sibling per level, plus the two
+  // children of the node it splits
+  if (depth >= BVH_MAX_DEPTH-1) return index;
+
+  // evaluate the surface area heuristic for binned splits along each axis
+  const Vec3f &cmin = centroid_bbox.getMin();
+  const Vec3f &cmax = centroid_bbox.getMax();
+  int best_axis = -1;
+  int best_bin = -1;
+  double best_cost = 0;
+  for (int axis = 0; axis < 3; axis++) {
+    double extent = cmax[axis]-cmin[axis];
+    if (extent <= 0) continue;
+    int counts[BVH_NUM_BINS] = { 0 };
+    BoundingBox bins[BVH_NUM_BINS];
+    for (int i = first; i < last; i++) {
+      int b = std::min(BVH_NUM_BINS-1,int(BVH_NUM_BINS*(centroids[i][axis]-cmin[axis])/extent));
+      if (counts[b] == 0) bins[b] = bounds[i];
+      else bins[b].Extend(bounds[i]);
+      counts[b]++;
+    }
+    // sweep from the right to get the area & count to the right of each split
+    double right_area[BVH_NUM_BINS];
+    int right_count[BVH_NUM_BINS];
+    BoundingBox acc;
+    int count = 0;
+    for (int b = BVH_NUM_BINS-1; b > 0; b--) {
+      if (counts[b] > 0) {
+        if (count == 0) acc = bins[b];
+        else acc.Extend(bins[b]);
+        count += counts[b];
+      }
+      right_area[b] = (count > 0) ? SurfaceArea(acc) : 0;
+      right_count[b] = count;
+    }
+    // then from the left, splitting between bin b-1 and bin b
+    count = 0;
+    for (int b = 1; b < BVH_NUM_BINS; b++) {
+      if (counts[b-1] > 0) {
+        if (count == 0) acc = bins[b-1];
+        else acc.Extend(bins[b-1]);
+        count += counts[b-1];
+      }
+      if (count == 0 || right_count[b] == 0) continue;
+      double cost = count*SurfaceArea(acc) + right_count[b]*right_area[b];
+      if (best_axis == -1 || cost < best_cost) {
+        best_axis = axis;
+        best_bin = b;
+        best_cost = cost;
+      }
+    }
+  }
+  // all centroids coincide, nothing to split
+  if (best_axis == -1) return index;
+
+  // compare against the cost of making this node a leaf
+  double node_area = SurfaceArea(node_bbox);
+  double split_cost = BVH_TRAVERSAL_COST + (node_area > 0 ? best_cost/node_area : 0);
+  if (split_cost >= n && n <= BVH_MAX_ITEMS_PER_LEAF) return index;
+
+  // partition the items (and their bounds & centroids) into the two halves
+  double extent = cmax[best_axis]-cmin[best_axis];
+  int mid = first;
+  for (int i = first; i < last; i++) {
+    int b = std::min(BVH_NUM_BINS-1,int(BVH_NUM_BINS*(centroids[i][best_axis]-cmin[best_axis])/extent));
+    if (b < best_bin) {
+      std::swap(items[i],items[mid]);
+      std::swap(bounds[i],bounds[mid]);
+      std::swap(centroids[i],centroids[mid]);
+      mid++;
+    }
+  }
+  assert (mid > first && mid < last);
+
+  Build(bounds,centroids,first,mid,depth+1);
+  int child2 = Build(bounds,centroids,mid,last,depth+1);
+  nodes[index].offset = child2;
+  nodes[index].count = 0;
+  nodes[index].axis = best_axis;
+  return index;
+}
+
+// ====================================================================
+// RAY CASTING
+// ====================================================================
+
+bool BVH::IntersectItem(const BVHItem &item, const Ray &ray, Hit &h, bool intersect_backfacing) const {
+  // intersect into a fresh hit, so that a closer face doesn't inherit
+  // the primitive of an earlier (farther) hit
+  Hit tmp(h.getT());
+  if (item.type == BVH_PRIMITIVE) {
+    if (!item.prim->intersect(ray,tmp)) return false;
+    // some primitives report their hit regardless of the current closest t
+    if (tmp.getT() >= h.getT()) return false;
+  } else {
+    if (!triangles.Intersect(item.triangle,ray,tmp,intersect_backfacing) &&
+        !triangles.Intersect(item.triangle+1,ray,tmp,intersect_backfacing)) return false;
+  }
+  h = tmp;
+  return true;
+}
+
+bool BVH::IntersectLeaf(const BVHNode &node, const Ray &ray, const FloatRay &float_ray, Hit &h,
+                        enum BVH_ITEM_TYPE skip, bool intersect_backfacing, bool any_hit) const {
+  bool answer = false;
+  // the analytic primitives
+  for (int i = node.offset; i < node.offset+node.count; i++) {
+    if (items[i].type != BVH_PRIMITIVE || items[i].type == skip) continue;
+    if (IntersectItem(items[i],ray,h,intersect_backfacing)) {
+      if (any_hit) return true;
+      answer = true;
+    }
+  }
+  // the triangles, a block at a time: the SIMD filter picks the
+  // candidates, the exact test decides
+  int end = node.first_triangle + node.num_triangles;
+  for (int first = node.first_triangle; first < end; first += TRIANGLE_BLOCK_SIZE) {
+    unsigned int mask = triangles.Filter(first,std::min(TRIANGLE_BLOCK_SIZE,end-first),float_ray);
+    while (mask) {
+      int tri = first + __builtin_ctz(mask);
+      mask &= mask-1;
+      if (items[triangle_items[tri]].type == skip) continue;
+      // intersect into a fresh hit (see IntersectItem)
+      Hit tmp(h.getT());
+      if (!triangles.Intersect(tri,ray,tmp,intersect_backfacing)) continue;
+      h = tmp;
+      if (any_hit) return true;
+      answer = true;
+    }
+  }
+  return answer;
+}
+
+bool BVH::CastRay(const Ray &ray, Hit &h, bool use_rasterized_patches, bool intersect_backfacing) const {
+  if (nodes.empty()) return false;
+  Vec3r origin(ray.getOrigin());
+  const Vec3f &direction = ray.getDirection();
+  FloatRay float_ray(ray);
+  real inv_direction[3];
+  for (int k = 0; k < 3; k++) {
+    inv_direction[k] = 1.0 / direction[k];
+  }
+  // the type of item that is skipped for this query
+  enum BVH_ITEM_TYPE skip = use_rasterized_patches ? BVH_PRIMITIVE : BVH_RASTERIZED_FACE;
+
+  bool answer = false;
+  int todo[BVH_MAX_DEPTH];
+  int num_todo = 0;
+  todo[num_todo++] = 0;
+  while (num_todo > 0) {
+    const BVHNode &node = nodes[todo[--num_todo]];
+    // clip to the closest hit so far
+    if (!IntersectNode(node,origin,inv_direction,h.getT())) continue;
+    if (node.isLeaf()) {
+      if (IntersectLeaf(node,ray,float_ray,h,skip,intersect_backfacing,false)) answer = true;
+    } else {
+      PushChildren(node,direction,todo,num_todo);
+    }
+  }
+  return answer;
+}
+
+bool BVH::Occluded(const Ray &ray, double max_t, bool use_rasterized_patches, bool intersect_backfacing) const {
+  if (nodes.empty()) return false;
+  Vec3r origin(ray.getOrigin());
+  const Vec3f &direction = ray.getDirection();
+  FloatRay float_ray(ray);
+  real inv_direction[3];
+  for (int k = 0; k < 3; k++) {
+    inv_direction[k] = 1.0 / direction[k];
+  }
+  enum BVH_ITEM_TYPE skip = use_rasterized_patches ? BVH_PRIMITIVE : BVH_RASTERIZED_FACE;
+
+  int todo[BVH_MAX_DEPTH];
+  int num_todo = 0;
+  todo[num_todo++] = 0;
+  while (num_todo > 0) {
+    const BVHNode &node = nodes[todo[--num_todo]];
+    if (!IntersectNode(node,origin,inv_direction,max_t)) continue;
+    if (node.isLeaf()) {
+      // any hit closer than max_t will do
+      Hit h(max_t);
+      if (IntersectLeaf(node,ray,float_ray,h,skip,intersect_backfacing,true)) return true;
+    } else {
+      PushChildren(node,direction,todo,num_todo);
+    }
+  }
+  return false;
+}
+
+void BVH::PushChildren(const BVHNode &node, const Vec3f &direction, int *todo, int &num_todo) const {
+  // visit the child on the near side of the split first (push it last)
+  int child1 = &node - &nodes[0] + 1;
+  int child2 = node.offset;
+  assert (num_todo+2 <= BVH_MAX_DEPTH);
+  if (direction[node.axis] < 0) {
+    todo[num_todo++] = child1;
+    todo[num_todo++] = child2;
+  } else {
+    todo[num_todo++] = child2;
+    todo[num_todo++] = child1;
+  }
+}
+
+// ====================================================================
@@ -0,0 +1,86 @@
+#ifndef _BVH_H_
+#define _BVH_H_
+
+#include <vector>
+#include "vectors.h"
+#include "boundingbox.h"
+#include "triangle_buffer.h"
+
+class Mesh;
+class Face;
+class Primitive;
+class Ray;
+class Hit;
+
+// ====================================================================
+// A bounding volume hierarchy over everything a ray can hit: the
+// original quads, the rasterized primitive faces and the analytic
+// primitives.  The tree is built once (binned surface area heuristic)
+// and stored depth first in a single node array: an interior node's
+// first child immediately follows it and the index of its second
+// child is stored in the node.  The quads & rasterized faces are
+// intersected through a TriangleBuffer, filled in leaf order so the
+// triangles of a leaf are contiguous and can be filtered a block at a
+// time with the SIMD kernels.  The tree (and the order of the items)
+// is saved in the scene cache, if there is one, and read back from it
+// instead of being built again.
+// ====================================================================
+
+enum BVH_ITEM_TYPE { BVH_ORIGINAL_QUAD, BVH_RASTERIZED_FACE, BVH_PRIMITIVE };
+
+class BVHItem {
+public:
+  BVHItem(enum BVH_ITEM_TYPE t, Face *f, Primitive *p) : type(t), face(f), prim(p), triangle(-1) {}
+  enum BVH_ITEM_TYPE type;
+  Face *face;       // for original quads & rasterized faces
+  Primitive *prim;  // for analytic primitives
+  int triangle;     // for faces: the first of its two triangles in the TriangleBuffer
+};
+
+class BVHNode {
+public:
+  bool isLeaf() const { return count > 0; }
+  real min[3];
+  real max[3];
+  int offset;  // leaf: index of the first item, interior: index of the second child
+  int count;   // leaf: number of items, interior: 0
+  int axis;    // interior: split axis (to visit the nearer child first)
+  int first_triangle;  // leaf: the triangles of its faces in the TriangleBuffer
+  int num_triangles;
+};
+
+class BVH {
+
+public:
+
+  // CONSTRUCTOR
+  BVH(Mesh *m);
+
+  // ACCESSORS
+  int numNodes() const { return nodes.size(); }
+  int numItems() const { return items.size(); }
+
+  // find the closest hit along the ray (either against the rasterized
+  // primitive faces or against the analytic primitives)
+  bool CastRay(const Ray &ray, Hit &h, bool use_rasterized_patches, bool intersect_backfacing) const;
+  // is there any hit along the ray with t < max_t?  (stops at the first one)
+  bool Occluded(const Ray &ray, double max_t, bool use_rasterized_patches, bool intersect_backfacing) const;
+
+private:
+
+  // HELPER FUNCTIONS
+  int Build(std::vector<BoundingBox> &bounds, std::vector<Vec3f> &centroids, int first, int last, int depth);
+  bool IntersectItem(const BVHItem &item, const Ray &ray, Hit &h, bool intersect_backfacing) const;
+  bool IntersectLeaf(const BVHNode &node, const Ray &ray, const FloatRay &float_ray, Hit &h,
+                     enum BVH_ITEM_TYPE skip, bool intersect_backfacing, bool any_hit) const;
+  void PushChildren(const BVHNode &node, const Vec3f &direction, int *todo, int &num_todo) const;
+
+  // REPRESENTATION
+  std::vector<BVHNode> nodes;
+  std::vector<BVHItem> items;
+  TriangleBuffer triangles;
+  // the item each triangle belongs to
+  std::vector<int> triangle_items;
+};
+
+#endif
@@ -23,6 +23,9 @@ public:
 
   // for ray tracing
   bool intersect(const Ray &r, Hit &h) const;
+  BoundingBox getBoundingBox() const {
+    Vec3f r(outer_radius,height/2.0,outer_radius);
+    return BoundingBox(center-r,center+r); }
 
   // for OpenGL rendering & radiosity
   void addRasterizedFaces(Mesh *m, ArgParser *args);
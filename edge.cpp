@@ -2,7 +2,8 @@
 #include "edge.h"
 
 // EDGE CONSTRUCTOR
-Edge::Edge(Vertex *vs, Vertex *ve, Face *f) {
+Edge::Edge(unsigned int h, Vertex *vs, Vertex *ve, Face *f) {
+  handle = h;
   start_vertex = vs;
   end_vertex = ve;
   face = f;
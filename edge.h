@@ -16,11 +16,13 @@ public:
 
   // ========================
   // CONSTRUCTORS & DESTRUCTOR
-  Edge(Vertex *vs, Vertex *ve, Face *f);
+  // (h is the edge's slot in the mesh's edge pool)
+  Edge(unsigned int h, Vertex *vs, Vertex *ve, Face *f);
   ~Edge();
 
   // =========
   // ACCESSORS
+  unsigned int getHandle() const { return handle; }
   Vertex* getStartVertex() const { assert (start_vertex != NULL); return start_vertex; }
   Vertex* getEndVertex() const { assert (end_vertex != NULL); return end_vertex; }
   Edge* getNext() const { assert (next != NULL); return next; }
@@ -67,6 +69,7 @@ private:
   Face *face;
   Edge *opposite;
   Edge *next;
+  unsigned int handle;
 };
 
 // ===================================================================
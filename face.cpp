@@ -41,15 +41,18 @@ double Face::getArea() const {
 
 // =========================================================================
 
-Vec3f Face::RandomPoint() const {
+Vec3f Face::RandomPoint(Sampler &sampler) const {
+  double s = sampler.rand(); // random real in [0,1)
+  double t = sampler.rand(); // random real in [0,1)
+  return PointAt(s,t);
+}
+
+Vec3f Face::PointAt(double s, double t) const {
 	Vec3f a = get<0>(this)->get();//(*this)[0]->get();
 	Vec3f b = get<1>(this)->get();//(*this)[1]->get();
 	Vec3f c = get<2>(this)->get();//(*this)[2]->get();
 	Vec3f d = get<3>(this)->get();//(*this)[3]->get();
 
-  double s = GLOBAL_mtrand.rand(); // random real in [0,1]
-  double t = GLOBAL_mtrand.rand(); // random real in [0,1]
-
   Vec3f answer = s*t*a + s*(1-t)*b + (1-s)*t*d + (1-s)*(1-t)*c;
   return answer;
 }
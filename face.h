@@ -7,6 +7,7 @@
 #include "hit.h"
 #include "argparser.h"
 #include "material.h"
+#include "sampler.h"
 
 // ==============================================================
 // Simple class to store quads for use in radiosity & raytracing.
@@ -17,12 +18,15 @@ public:
 
   // ========================
   // CONSTRUCTOR & DESTRUCTOR
-  Face(Material *m) {
+  // (h is the face's slot in the mesh's face pool)
+  Face(unsigned int h, Material *m) {
+    handle = h;
     edge = NULL;
     material = m; }
 
   // =========
   // ACCESSORS
+  unsigned int getHandle() const { return handle; }
   Vertex* operator[](int i) const { 
     assert (edge != NULL);
     if (i==0) return edge->getStartVertex();
@@ -44,7 +48,9 @@ public:
   }
   Material* getMaterial() const { return material; }
   double getArea() const;
-  Vec3f RandomPoint() const;
+  Vec3f RandomPoint(Sampler &sampler) const;
+  // the point at (s,t) in [0,1]x[0,1] of the bilinear patch
+  Vec3f PointAt(double s, double t) const;
    Vec3f computeNormal() const;
 
   // =========
@@ -82,6 +88,7 @@ protected:
   
   int radiosity_patch_index;  // an awkward pointer to this patch in the Radiosity patch array
   Material *material;
+  unsigned int handle;
 };
 
 // ===========================================================
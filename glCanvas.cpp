@@ -22,6 +22,8 @@
 #include "raytree.h"
 #include "utils.h"
 #include "primitive.h"
+#include "image.h"
+#include "tile_renderer.h"
 
 // ========================================================
 // static variables of GLCanvas class
@@ -247,13 +249,21 @@ void GLCanvas::keyboard(unsigned char key, int x, int y) {
             } else
                 printf ("raytracing animation stopped, press 'R' to start\n");    
             break;
+        case 'f':  case 'F': {
+            // render the final frame on all cores and show it
+            TileRenderer renderer(raytracer,args);
+            printf ("rendering %d tiles...\n", renderer.numTiles());
+            Image image;
+            renderer.Render(image);
+            DrawImage(image);
+            break; }
         case 't':  case 'T': {
             // visualize the ray tree for the pixel at the current mouse position
             int i = x;
             int j = glutGet(GLUT_WINDOW_HEIGHT)-y;
             RayTree::Activate();
             raytracing_skip = 1;
-            TraceRay(i,j);
+            raytracer->TracePixel(i,j);
             RayTree::Deactivate();
             // redraw
             Render();
@@ -372,80 +382,6 @@ void GLCanvas::keyboard(unsigned char key, int x, int y) {
 }
 
 
-// trace a ray through pixel (i,j) of the image an return the color
-Vec3f GLCanvas::TraceRay(int i, int j) {
-    // compute and set the pixel color
-    int max_d = std::max(args->width,args->height);
-    
-    if (args->num_antialias_samples <= 1) {
-        assert (i >= 0 && i < args->width);
-        assert (j >= 0 && j < args->height);
-        // convert integer pixel coordinates from (0,1)->(width-1,height-1)
-        // into floating point coordinates (0,0)->(1,1)
-        double x = (i+0.5-args->width/2.0)/double(max_d)+0.5;
-        double y = (j+0.5-args->height/2.0)/double(max_d)+0.5;
-        assert (x >= 0.0 && x <= 1.0);
-        assert (y >= 0.0 && y <= 1.0);
-        Ray r = mesh->getCamera()->generateRay(x,y);
-        Hit hit;
-        Vec3f color = raytracer->TraceRay(r,hit);
-        RayTree::AddMainSegment(r,0,hit.getT());
-        return color;
-    } else {
-        // ==========================================
-        // ASSIGNMENT:  IMPLEMENT ANTIALIASING
-        // ==========================================
-        Vec3f color;
-        
-        int N = args->num_antialias_samples;
-        
-        for (int h = 0; h < N; ++h) {
-            assert (i >= 0 && i < args->width);
-            assert (j >= 0 && j < args->height);
-            
-            double rand = GLOBAL_mtrand.rand();
-            double rotation = 2 * M_PI * rand;
-            
-            double away = (double)h / N;
-            double around = h * rotation;
-            
-            // convert integer pixel coordinates from (0,1)->(width-1,height-1)
-            // into floating point coordinates (0,0)->(1,1)
-            double I = i;
-            double J = j;
-            
-            I += (std::cos(around) / 1.0) * away;
-            J += (std::sin(around) / 1.0) * away;
-            
-            double x = (I+0.5-args->width/2.0)/double(max_d)+0.5;
-            double y = (J+0.5-args->height/2.0)/double(max_d)+0.5;
-            
-            if (x < 0.0) {
-                x = 0.0;
-            } else if (x > 1.0) {
-                x = 1.0;
-            }
-            if (y < 0.0) {
-                y = 0.0;
-            } else if (y > 1.0) {
-                y = 1.0;
-            }
-            Ray r = mesh->getCamera()->generateRay(x,y);
-            Hit hit;
-            color += raytracer->TraceRay(r,hit) * rand;
-            RayTree::AddMainSegment(r,0,hit.getT());
-            //return color;
-        }
-        
-        color /= N;
-       
-        // return the average color
-        return color;        
-    }
-}
-
-
-
 // Scan through the image from the lower left corner across each row
 // and then up to the top right.  Initially the image is sampled very
 // coarsely.  Increment the static variables that track the progress
@@ -468,7 +404,7 @@ int GLCanvas::DrawPixel() {
     }
     
     // compute the color and position of intersection
-    Vec3f color= TraceRay(raytracing_x, raytracing_y);
+    Vec3f color= raytracer->TracePixel(raytracing_x, raytracing_y);
     double r = linear_to_srgb(color.x());
     double g = linear_to_srgb(color.y());
     double b = linear_to_srgb(color.z());
@@ -481,6 +417,22 @@ int GLCanvas::DrawPixel() {
 }
 
 
+// copy a rendered image (e.g., from the TileRenderer) to the screen
+void GLCanvas::DrawImage(Image &image) {
+    glDrawBuffer(GL_FRONT);
+    glDisable(GL_LIGHTING);
+    glDisable(GL_DEPTH_TEST);
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    glRasterPos2f(-1,-1);
+    glPixelStorei(GL_UNPACK_ALIGNMENT,1);
+    glDrawPixels(image.Width(),image.Height(),GL_RGB,GL_UNSIGNED_BYTE,image.getGLPixelData());
+    glFlush();
+}
+
+
 void GLCanvas::idle() {
     if (args->radiosity_animation) {
         double undistributed = radiosity->Iterate();
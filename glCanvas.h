@@ -14,6 +14,7 @@ class Mesh;
 class RayTracer;
 class Radiosity;
 class PhotonMapping;
+class Image;
 
 // ====================================================================
 // NOTE:  All the methods and variables of this class are static
@@ -63,7 +64,7 @@ private:
   static void idle();
   
   static int DrawPixel();
-  static Vec3f TraceRay(int i, int j);
+  static void DrawImage(Image &image);
 };
 
 // ====================================================================
@@ -20,6 +20,9 @@
 #endif
 #endif
 
+#include <vector>
+#include <algorithm>
+#include <cassert>
 class Edge;
 class Triangle;
 #include "vertex.h"
@@ -29,36 +32,131 @@ class Triangle;
 
 
 // ===================================================================================
-// DIRECTED EDGES are stored in a hash table using a simple hash
-// function based on the indices of the start and end vertices
+// DIRECTED EDGES are stored in a flat open addressing hash table
+// (linear probing), keyed on the indices of the start and end vertices
+// packed into 64 bits.  The table holds the 32 bit handles of the
+// edges (see object_pool.h).  Removing an edge shifts the entries
+// after it back, so there are no tombstones and lookups stay short.
 // ===================================================================================
 
-inline unsigned int ordered_two_int_hash(unsigned int a, unsigned int b) {
-  return LARGE_PRIME_A * a + LARGE_PRIME_B * b;
-}
-
-struct orderedvertexpairhash {
-  size_t operator()(std::pair<Vertex*,Vertex*> p) const {
-    return ordered_two_int_hash(p.first->getIndex(),p.second->getIndex());
-  }
-};
-
-struct orderedsamevertexpair {
-  bool operator()(std::pair<Vertex*,Vertex*> p1, std::pair<Vertex*,Vertex*>p2) const {
-    if (p1.first->getIndex() == p2.first->getIndex() && p1.second->getIndex() == p2.second->getIndex())
-      return true;
-    return false;
-  }
+// the handle find returns for a missing edge
+#define EDGE_HASH_NONE 0xffffffffu
+// grow when the table is more than 70% full
+#define EDGE_HASH_MAX_LOAD_PERCENT 70
+
+class EdgeHashTable {
+
+public:
+
+  // CONSTRUCTOR
+  EdgeHashTable() : mask(0), num_entries(0) {}
+
+  // ACCESSORS
+  int size() const { return num_entries; }
+  // the edge from vertex a to vertex b, or EDGE_HASH_NONE
+  unsigned int find(unsigned int a, unsigned int b) const {
+    if (num_entries == 0) return EDGE_HASH_NONE;
+    unsigned long long key = Key(a,b);
+    for (size_t i = Mix(key) & mask; ; i = (i+1) & mask) {
+      if (slots[i].key == key) return slots[i].edge;
+      if (slots[i].key == EMPTY_KEY) return EDGE_HASH_NONE;
+    } }
+  // (for visiting all the edges) each slot is empty or holds an edge
+  int numSlots() const { return slots.size(); }
+  unsigned int getSlotEdge(int i) const {
+    return (slots[i].key == EMPTY_KEY) ? EDGE_HASH_NONE : slots[i].edge; }
+
+  // MODIFIERS
+  // make room for n edges in all (without rehashing)
+  void reserve(int n) {
+    size_t capacity = 16;
+    while (capacity * EDGE_HASH_MAX_LOAD_PERCENT < 100 * (size_t)n) capacity *= 2;
+    if (capacity > slots.size()) Rehash(capacity); }
+  // add the edge from a to b (which must not be there yet)
+  void insert(unsigned int a, unsigned int b, unsigned int edge) {
+    assert (edge != EDGE_HASH_NONE);
+    if (100 * (size_t)(num_entries+1) > slots.size() * EDGE_HASH_MAX_LOAD_PERCENT) {
+      Rehash(std::max((size_t)16, 2*slots.size()));
+    }
+    unsigned long long key = Key(a,b);
+    size_t i = Mix(key) & mask;
+    while (slots[i].key != EMPTY_KEY) {
+      assert (slots[i].key != key);
+      i = (i+1) & mask;
+    }
+    slots[i].key = key;
+    slots[i].edge = edge;
+    num_entries++; }
+  // remove the edge from a to b (which must be there)
+  void erase(unsigned int a, unsigned int b) {
+    unsigned long long key = Key(a,b);
+    size_t i = Mix(key) & mask;
+    while (slots[i].key != key) {
+      assert (slots[i].key != EMPTY_KEY);
+      i = (i+1) & mask;
+    }
+    // fill the hole with a later entry of the same run that may not be
+    // past it (one whose home slot is at or before the hole), & repeat
+    for (size_t j = (i+1) & mask; slots[j].key != EMPTY_KEY; j = (j+1) & mask) {
+      size_t home = Mix(slots[j].key) & mask;
+      if (((j - home) & mask) >= ((j - i) & mask)) {
+        slots[i] = slots[j];
+        i = j;
+      }
+    }
+    slots[i].key = EMPTY_KEY;
+    num_entries--; }
+
+private:
+
+  static const unsigned long long EMPTY_KEY = ~0ULL;
+
+  class Slot {
+  public:
+    unsigned long long key;
+    unsigned int edge;
+  };
+
+  static unsigned long long Key(unsigned int a, unsigned int b) {
+    assert (a != EDGE_HASH_NONE && b != EDGE_HASH_NONE);
+    return ((unsigned long long)a << 32) | b; }
+  // (the splitmix64 finalizer: every bit of the key affects the low bits)
+  static size_t Mix(unsigned long long k) {
+    k = (k ^ (k >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    k = (k ^ (k >> 27)) * 0x94d049bb133111ebULL;
+    return k ^ (k >> 31); }
+  void Rehash(size_t capacity) {
+    std::vector<Slot> old;
+    old.swap(slots);
+    Slot empty;
+    empty.key = EMPTY_KEY;
+    empty.edge = EDGE_HASH_NONE;
+    slots.assign(capacity,empty);
+    mask = capacity-1;
+    for (size_t s = 0; s < old.size(); s++) {
+      if (old[s].key == EMPTY_KEY) continue;
+      size_t i = Mix(old[s].key) & mask;
+      while (slots[i].key != EMPTY_KEY) i = (i+1) & mask;
+      slots[i] = old[s];
+    } }
+
+  // REPRESENTATION
+  std::vector<Slot> slots;  // a power of 2 of them
+  size_t mask;
+  int num_entries;
 };
 
 
-
 // ===================================================================================
 // PARENT/CHILD VERTEX relationships (for subdivision) are stored in a
 // hash table using a simple hash function based on the indices of the
 // parent vertices, smaller index first
 // ===================================================================================
 
+inline unsigned int ordered_two_int_hash(unsigned int a, unsigned int b) {
+  return LARGE_PRIME_A * a + LARGE_PRIME_B * b;
+}
+
 inline unsigned int unordered_two_int_hash(unsigned int a, unsigned int b) {
   assert (a != b);
   if (b < a) {
@@ -88,21 +186,17 @@ struct unorderedsamevertexpair {
 // NOTE: You may need to adjust these depending on your installation
 #ifdef __APPLE__
 typedef __gnu_cxx::hash_map<std::pair<Vertex*,Vertex*>,Vertex*,unorderedvertexpairhash,unorderedsamevertexpair> vphashtype;
-typedef __gnu_cxx::hash_map<std::pair<Vertex*,Vertex*>,Edge*,orderedvertexpairhash,orderedsamevertexpair> edgeshashtype;
 #else
 #ifdef __CYGWIN__
 typedef __gnu_cxx::hash_map<std::pair<Vertex*,Vertex*>,Vertex*,unorderedvertexpairhash,unorderedsamevertexpair> vphashtype;
-typedef __gnu_cxx::hash_map<std::pair<Vertex*,Vertex*>,Edge*,orderedvertexpairhash,orderedsamevertexpair> edgeshashtype;
 #else
 // UNIX
 #ifdef __FREEBSD__
 // for older versions of unix without unordered maps (e.g., the submission server)
 typedef __gnu_cxx::hash_map<std::pair<Vertex*,Vertex*>,Vertex*,unorderedvertexpairhash,unorderedsamevertexpair> vphashtype;
-typedef __gnu_cxx::hash_map<std::pair<Vertex*,Vertex*>,Edge*,orderedvertexpairhash,orderedsamevertexpair> edgeshashtype;
 #else
 // newer versions 
 typedef std::unordered_map<std::pair<Vertex*,Vertex*>,Vertex*,unorderedvertexpairhash,unorderedsamevertexpair> vphashtype;
-typedef std::unordered_map<std::pair<Vertex*,Vertex*>,Edge*,orderedvertexpairhash,orderedsamevertexpair> edgeshashtype;
 #endif
 #endif
 #endif
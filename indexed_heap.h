@@ -0,0 +1,84 @@
+#ifndef _INDEXED_HEAP_H_
+#define _INDEXED_HEAP_H_
+
+#include <vector>
+#include <cassert>
+
+// ====================================================================
+// A max-heap of the items 0..n-1, ordered by a key that can be changed
+// at any time: the heap remembers where each item is, so changing a
+// key just sifts that one item up or down (O(log n)).  Ties go to the
+// smaller item, so the top does not depend on the order in which the
+// keys were changed.
+// ====================================================================
+
+class IndexedHeap {
+
+public:
+
+  // ACCESSORS
+  int size() const { return heap.size(); }
+  // the item with the largest key
+  int top() const { assert (size() > 0); return heap[0]; }
+  double getKey(int i) const {
+    assert (i >= 0 && i < size());
+    return keys[i]; }
+
+  // MODIFIERS
+  // (re)build the heap over the items 0..keys.size()-1, in O(n)
+  void Initialize(const std::vector<double> &k) {
+    keys = k;
+    int n = keys.size();
+    heap.resize(n);
+    position.resize(n);
+    for (int i = 0; i < n; i++) {
+      heap[i] = i;
+      position[i] = i;
+    }
+    for (int p = n/2-1; p >= 0; p--) {
+      SiftDown(p);
+    } }
+  void Update(int i, double key) {
+    assert (i >= 0 && i < size());
+    keys[i] = key;
+    SiftUp(position[i]);
+    SiftDown(position[i]); }
+
+private:
+
+  // HELPER FUNCTIONS
+  // should item a be above item b?
+  bool Above(int a, int b) const {
+    return keys[a] > keys[b] || (keys[a] == keys[b] && a < b); }
+  void Swap(int p, int q) {
+    int a = heap[p];
+    int b = heap[q];
+    heap[p] = b;  position[b] = p;
+    heap[q] = a;  position[a] = q; }
+  void SiftUp(int p) {
+    while (p > 0 && Above(heap[p],heap[(p-1)/2])) {
+      Swap(p,(p-1)/2);
+      p = (p-1)/2;
+    } }
+  void SiftDown(int p) {
+    int n = size();
+    while (true) {
+      int best = p;
+      int left = 2*p+1;
+      int right = 2*p+2;
+      if (left < n && Above(heap[left],heap[best])) best = left;
+      if (right < n && Above(heap[right],heap[best])) best = right;
+      if (best == p) return;
+      Swap(p,best);
+      p = best;
+    } }
+
+  // REPRESENTATION
+  std::vector<double> keys;   // the key of each item
+  std::vector<int> heap;      // the items, in heap order
+  std::vector<int> position;  // where each item is in heap
+};
+
+// ====================================================================
+
+#endif
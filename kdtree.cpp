@@ -1,166 +1,228 @@
 #include "kdtree.h"
 
-#include <pthread.h>
+#include <algorithm>
 
-#define MAX_PHOTONS_BEFORE_SPLIT 100
-#define MAX_DEPTH 18
-
-// ==================================================================
-// DESTRUCTOR
 // ==================================================================
-KDTree::~KDTree() {
-  if (!isLeaf()) {
-    delete child1;
-    delete child2;
-  } else {
-    // delete all the photons (this is done automatically since they
-    // are stored directly in an STL vector, not using pointers)
-  }
+// HELPER FUNCTIONS
+
+// the number of nodes in the left subtree of a left-balanced tree
+// with n nodes (all levels full except the last, which is filled
+// from the left)
+static int LeftBalancedSize(int n) {
+  assert (n >= 1);
+  if (n == 1) return 0;
+  int m = 1;
+  while (2*m <= n) m *= 2;
+  // m/2-1 nodes in the full levels of the left subtree, plus as many
+  // of the last level's n-m+1 nodes as fit in its half
+  return m/2 - 1 + std::min(n-m+1, m/2);
 }
 
+static Vec3f ReplaceComponent(const Vec3f &v, int axis, double value) {
+  if (axis == 0) return Vec3f(value,v.y(),v.z());
+  if (axis == 1) return Vec3f(v.x(),value,v.z());
+  assert (axis == 2);
+  return Vec3f(v.x(),v.y(),value);
+}
+
+class PhotonAxisLess {
+ public:
+  PhotonAxisLess(int a) : axis(a) {}
+  bool operator()(const CompactPhoton &a, const CompactPhoton &b) const {
+    return a.getPosition(axis) < b.getPosition(axis); }
+ private:
+  int axis;
+};
+
 
 // ==================================================================
-// HELPER FUNCTIONS
+// BUILD
+// ==================================================================
 
-bool KDTree::PhotonInCell(const Photon &p) const {
-  const Vec3f& min = bbox.getMin();
-  const Vec3f& max = bbox.getMax();
-  const Vec3f &position = p.getPosition();
-  if (position.x() > min.x() - EPSILON &&
-      position.y() > min.y() - EPSILON &&
-      position.z() > min.z() - EPSILON &&
-      position.x() < max.x() + EPSILON &&
-      position.y() < max.y() + EPSILON &&
-      position.z() < max.z() + EPSILON)
-    return true;
-  return false;
+void KDTree::Build(std::vector<CompactPhoton> &p) {
+  file.Close();
+  num_photons = p.size();
+  photons.clear();
+  photons.resize(num_photons);
+  data = photons.empty() ? NULL : &photons[0];
+  if (num_photons > 0) {
+    Balance(p,0,num_photons,0);
+  }
+  p.clear();
 }
 
-bool KDTree::overlaps(const BoundingBox &bb) const {
-  const Vec3f& bb_min = bb.getMin();
-  const Vec3f& bb_max = bb.getMax();
-  const Vec3f& my_min = bbox.getMin();
-  const Vec3f& my_max = bbox.getMax();
-  if (bb_min.x() > my_max.x()) return false;
-  if (my_min.x() > bb_max.x()) return false;
-  if (bb_min.y() > my_max.y()) return false;
-  if (my_min.y() > bb_max.y()) return false;
-  if (bb_min.z() > my_max.z()) return false;
-  if (my_min.z() > bb_max.z()) return false;
+bool KDTree::Map(const std::string &filename, size_t offset, int n) {
+  photons.clear();
+  data = NULL;
+  num_photons = 0;
+  if (!file.Open(filename)) return false;
+  if (n < 0 || offset % sizeof(float) != 0 || offset > file.size() ||
+      (file.size() - offset) / sizeof(CompactPhoton) < (size_t)n) {
+    file.Close();
+    return false;
+  }
+  const CompactPhoton *p = (const CompactPhoton*)(file.getData() + offset);
+  // the split axis of each photon indexes its position
+  for (int i = 0; i < n; i++) {
+    if (p[i].getFlags() > 2) {
+      file.Close();
+      return false;
+    }
+  }
+  data = p;
+  num_photons = n;
   return true;
 }
 
-void KDTree::AddPhoton(const Photon &p)
-{
-    std::lock_guard<std::mutex> lk(m);
-    
-    AddPhoton2(p);
-}
+void KDTree::Balance(std::vector<CompactPhoton> &p, int first, int last, int index) {
+  int n = last-first;
+  assert (n >= 1);
+  assert (index < numPhotons());
 
-// ==================================================================
-void KDTree::AddPhoton2(const Photon &p) {
-  const Vec3f &position = p.getPosition();
-  assert (PhotonInCell(p));
-  if (isLeaf()) {
-    // this cell is a leaf node
-    photons.push_back(p);
-    if (photons.size() > MAX_PHOTONS_BEFORE_SPLIT && depth < MAX_DEPTH) {
-      SplitCell();
-    }
-  } else {
-    // this cell is not a leaf node
-    // decide which subnode to recurse into
-    if (split_axis == 0) {
-      if (position.x() < split_value)
-	child1->AddPhoton2(p);
-      else
-	child2->AddPhoton2(p);
-    } else if (split_axis == 1) {
-      if (position.y() < split_value)
-	child1->AddPhoton2(p);
-      else
-	child2->AddPhoton2(p);
-    } else {
-      assert (split_axis == 2);
-      if (position.z() < split_value)
-	child1->AddPhoton2(p);
-      else
-	child2->AddPhoton2(p);
+  // split along the longest axis of the photons in this range
+  float min[3], max[3];
+  for (int k = 0; k < 3; k++) {
+    min[k] = max[k] = p[first].getPosition(k);
+  }
+  for (int i = first+1; i < last; i++) {
+    for (int k = 0; k < 3; k++) {
+      float position = p[i].getPosition(k);
+      min[k] = std::min(min[k],position);
+      max[k] = std::max(max[k],position);
     }
   }
+  float dx = max[0]-min[0];
+  float dy = max[1]-min[1];
+  float dz = max[2]-min[2];
+  int axis;
+  if (dx >= dy && dx >= dz) axis = 0;
+  else if (dy >= dx && dy >= dz) axis = 1;
+  else axis = 2;
+
+  // partition around the median that keeps the tree left-balanced
+  int median = first + LeftBalancedSize(n);
+  std::nth_element(p.begin()+first, p.begin()+median, p.begin()+last, PhotonAxisLess(axis));
+  photons[index] = p[median];
+  photons[index].setFlags(axis);
+
+  if (median > first) Balance(p,first,median,getChild1(index));
+  if (last > median+1) Balance(p,median+1,last,getChild2(index));
 }
 
 
 // ==================================================================
+// QUERIES
+// ==================================================================
+
 void KDTree::CollectPhotonsInBox(const BoundingBox &bb, std::vector<Photon> &photons) const {
-  // explicitly store the queue of cells that must be checked (rather
+  if (numPhotons() == 0) return;
+  const Vec3f& bb_min = bb.getMin();
+  const Vec3f& bb_max = bb.getMax();
+  // explicitly store the queue of nodes that must be checked (rather
   // than write a recursive function)
-  std::vector<const KDTree*> todo;  
-  todo.push_back(this);
+  std::vector<int> todo;
+  todo.push_back(0);
   while (!todo.empty()) {
-    const KDTree *node = todo.back();
-    todo.pop_back(); 
-    if (!node->overlaps(bb)) continue;
-    if (node->isLeaf()) {
-      // if this cell overlaps & is a leaf, add all of the photons into the master list
-      // NOTE: these photons may not be inside of the query bounding box
-      const std::vector<Photon> &photons2 = node->getPhotons();
-      int num_photons = photons2.size();
-      for (int i = 0; i < num_photons; i++) {
-	photons.push_back(photons2[i]);
-      }
-    } else {
-      // if this cell is not a leaf, explore both children
-      todo.push_back(node->getChild1());
-      todo.push_back(node->getChild2());
-    } 
+    int node = todo.back();
+    todo.pop_back();
+    const CompactPhoton &p = getCompactPhoton(node);
+    Vec3f position = p.getPosition();
+    if (position.x() >= bb_min.x() && position.x() <= bb_max.x() &&
+        position.y() >= bb_min.y() && position.y() <= bb_max.y() &&
+        position.z() >= bb_min.z() && position.z() <= bb_max.z()) {
+      photons.push_back(p.getPhoton());
+    }
+    if (isLeaf(node)) continue;
+    // only explore the children on the same side(s) of the split plane as the box
+    int axis = getSplitAxis(node);
+    double split_value = position[axis];
+    int child1 = getChild1(node);
+    int child2 = getChild2(node);
+    if (bb_min[axis] <= split_value) todo.push_back(child1);
+    if (bb_max[axis] >= split_value && child2 < numPhotons()) todo.push_back(child2);
   }
 }
 
-
-// ==================================================================
-void KDTree::SplitCell() {
-    
-  const Vec3f& min = bbox.getMin();
-  const Vec3f& max = bbox.getMax();
-  double dx = max.x()-min.x();
-  double dy = max.y()-min.y();
-  double dz = max.z()-min.z();
-  // split this cell in the middle of the longest axis
-  Vec3f min1,min2,max1,max2;
-  if (dx >= dy && dx >= dz) {
-    split_axis = 0;
-    split_value = min.x()+dx/2.0;
-    min1 = Vec3f(min.x()    ,min.y(),min.z());
-    max1 = Vec3f(split_value,max.y(),max.z());
-    min2 = Vec3f(split_value,min.y(),min.z());
-    max2 = Vec3f(max.x()       ,max.y(),max.z());
-  } else if (dy >= dx && dy >= dz) {
-    split_axis = 1;
-    split_value = min.y()+dy/2.0;
-    min1 = Vec3f(min.x(),min.y()    ,min.z());
-    max1 = Vec3f(max.x(),split_value,max.z());
-    min2 = Vec3f(min.x(),split_value,min.z());
-    max2 = Vec3f(max.x(),max.y()    ,max.z());
-  } else {
-    assert (dz >= dx && dz >= dy);
-    split_axis = 2;
-    split_value = min.z()+dz/2.0;
-    min1 = Vec3f(min.x(),min.y(),min.z()    );
-    max1 = Vec3f(max.x(),max.y(),split_value);
-    min2 = Vec3f(min.x(),min.y(),split_value);
-    max2 = Vec3f(max.x(),max.y(),max.z()    );
+void KDTree::FindKNearest(const Vec3f &point, int k, double max_radius,
+                          std::vector<std::pair<double,int> > &nearest) const {
+  nearest.clear();
+  if (numPhotons() == 0 || k <= 0) return;
+  // nearest is kept as a max-heap on squared distance, so the current
+  // k-th nearest photon (the search radius) is always at the front
+  // (the traversal runs in the geometry precision, see vectors.h)
+  Vec3r p(point);
+  real radius2 = max_radius*max_radius;
+  // explicitly store the nodes that must be checked, along with the
+  // squared distance from the query point to the node's half space
+  std::vector<std::pair<int,real> > todo;
+  todo.push_back(std::make_pair(0,real(0)));
+  while (!todo.empty()) {
+    int node = todo.back().first;
+    real plane_distance2 = todo.back().second;
+    todo.pop_back();
+    // prune cells that are farther away than the current k-th photon
+    if (plane_distance2 > radius2) continue;
+    const CompactPhoton &photon = getCompactPhoton(node);
+    real dx = p.x() - photon.getPosition(0);
+    real dy = p.y() - photon.getPosition(1);
+    real dz = p.z() - photon.getPosition(2);
+    real d2 = dx*dx + dy*dy + dz*dz;
+    if (d2 < radius2) {
+      if ((int)nearest.size() == k) {
+        std::pop_heap(nearest.begin(),nearest.end());
+        nearest.pop_back();
+      }
+      nearest.push_back(std::make_pair(d2,node));
+      std::push_heap(nearest.begin(),nearest.end());
+      if ((int)nearest.size() == k) radius2 = nearest.front().first;
+    }
+    if (isLeaf(node)) continue;
+    // visit the child on the same side of the split plane first (it
+    // is pushed last), the other one only if the plane is close enough
+    int axis = getSplitAxis(node);
+    real diff = p[axis] - photon.getPosition(axis);
+    int near_child = (diff < 0) ? getChild1(node) : getChild2(node);
+    int far_child = (diff < 0) ? getChild2(node) : getChild1(node);
+    if (far_child < numPhotons()) todo.push_back(std::make_pair(far_child,std::max(plane_distance2,diff*diff)));
+    if (near_child < numPhotons()) todo.push_back(std::make_pair(near_child,plane_distance2));
   }
-  // create two new children
-  child1 = new KDTree(BoundingBox(min1,max1),depth+1);
-  child2 = new KDTree(BoundingBox(min2,max2),depth+1);
-  int num_photons = photons.size();
-  std::vector<Photon> tmp = photons;
-  photons.clear();
-  // add all the photons to one of those children
-  for (int i = 0; i < num_photons; i++) {
-    const Photon &p = tmp[i];
-    this->AddPhoton2(p);
+  std::sort_heap(nearest.begin(),nearest.end());
+}
+
+void KDTree::CollectCells(int max_depth, std::vector<BoundingBox> &cells) const {
+  if (numPhotons() == 0) return;
+  std::vector<int> todo;
+  std::vector<int> todo_depth;
+  std::vector<BoundingBox> todo_bbox;
+  todo.push_back(0);
+  todo_depth.push_back(0);
+  todo_bbox.push_back(bbox);
+  while (!todo.empty()) {
+    int node = todo.back();
+    int depth = todo_depth.back();
+    BoundingBox cell = todo_bbox.back();
+    todo.pop_back();
+    todo_depth.pop_back();
+    todo_bbox.pop_back();
+    if (isLeaf(node) || depth >= max_depth) {
+      cells.push_back(cell);
+      continue;
+    }
+    // split the cell at this photon
+    int axis = getSplitAxis(node);
+    double split_value = getCompactPhoton(node).getPosition(axis);
+    BoundingBox cell1(cell.getMin(),ReplaceComponent(cell.getMax(),axis,split_value));
+    BoundingBox cell2(ReplaceComponent(cell.getMin(),axis,split_value),cell.getMax());
+    todo.push_back(getChild1(node));
+    todo_depth.push_back(depth+1);
+    todo_bbox.push_back(cell1);
+    if (getChild2(node) < numPhotons()) {
+      todo.push_back(getChild2(node));
+      todo_depth.push_back(depth+1);
+      todo_bbox.push_back(cell2);
+    } else {
+      cells.push_back(cell2);
+    }
   }
 }
 
@@ -3,66 +3,82 @@
 
 #include <cstdlib>
 #include <vector>
+#include <utility>
 #include "vectors.h"
 #include "boundingbox.h"
 #include "photon.h"
+#include "mapped_file.h"
 
 // ==================================================================
 // A hierarchical spatial data structure to store photons.  This data
 // struture allows for fast nearby neighbor queries for use in photon
 // mapping.
+//
+// The tree is static and left-balanced (Jensen-style): every photon
+// is a node, the root is stored at index 0 and the children of node i
+// are stored at 2i+1 and 2i+2.  The whole tree lives in one
+// contiguous array of CompactPhotons (the split axis of each node is
+// kept in the photon's flags), so there are no child pointers to
+// chase.  The tree is built once, after all photons have been traced,
+// or the array is mapped from a saved photon map file as it is.
 
 class KDTree {
  public:
 
   // ========================
   // CONSTRUCTOR & DESTRUCTOR
-  KDTree(const BoundingBox &_bbox, int _depth=0) {
-    bbox = _bbox;
-    depth = _depth;
-    child1=NULL;
-    child2=NULL;
-  }
-  ~KDTree();
+  KDTree(const BoundingBox &_bbox) { bbox = _bbox; data = NULL; num_photons = 0; }
+  ~KDTree() {}
 
   // =========
   // ACCESSORS
   // boundingbox
   const Vec3f& getMin() const { return bbox.getMin(); }
   const Vec3f& getMax() const { return bbox.getMax(); }
-  bool overlaps(const BoundingBox &bb) const;
   // hierarchy
-  int getDepth() const { return depth; }
-  bool isLeaf() const { 
-    if (child1==NULL&&child2==NULL) return true;
-    assert (child1 != NULL && child2 != NULL);
-    return false; }
-  const KDTree* getChild1() const { assert (!isLeaf()); assert (child1 != NULL); return child1; }
-  const KDTree* getChild2() const { assert (!isLeaf()); assert (child2 != NULL); return child2; }
+  int numPhotons() const { return num_photons; }
+  static int getChild1(int i) { return 2*i+1; }
+  static int getChild2(int i) { return 2*i+2; }
+  bool isLeaf(int i) const { return getChild1(i) >= numPhotons(); }
+  int getSplitAxis(int i) const { return getCompactPhoton(i).getFlags(); }
   // photons
-  const std::vector<Photon>& getPhotons() const { return photons; }
+  const CompactPhoton& getCompactPhoton(int i) const {
+    assert (i >= 0 && i < numPhotons());
+    return data[i]; }
+  // all of them, in tree order (for saving)
+  const CompactPhoton* getCompactPhotons() const { return data; }
+  Photon getPhoton(int i) const { return getCompactPhoton(i).getPhoton(); }
   void CollectPhotonsInBox(const BoundingBox &bb, std::vector<Photon> &photons) const;
+  // the (at most) k photons closest to point and within max_radius
+  // (which may be infinite), as (squared distance, photon index)
+  // pairs sorted nearest first
+  void FindKNearest(const Vec3f &point, int k, double max_radius,
+                    std::vector<std::pair<double,int> > &nearest) const;
+  // the cells of the subdivision, down to (at most) the given depth
+  void CollectCells(int max_depth, std::vector<BoundingBox> &cells) const;
 
   // =========
   // MODIFIERS
-  void AddPhoton(const Photon &p);
-  void AddPhoton2(const Photon &p);
-  bool PhotonInCell(const Photon &p) const;
+  // balance the given photons into the tree (O(n log n)).  The input
+  // vector is used as scratch space and is cleared.
+  void Build(std::vector<CompactPhoton> &p);
+  // use the num_photons photons (already in tree order) stored at
+  // offset in the file, without reading them in (fails if there are
+  // fewer, or if one has no valid split axis)
+  bool Map(const std::string &filename, size_t offset, int num_photons);
 
  private:
 
   // HELPER FUNCTION
-  void SplitCell();
+  void Balance(std::vector<CompactPhoton> &p, int first, int last, int index);
 
   // REPRESENTATION
   BoundingBox bbox;
-  KDTree* child1;
-  KDTree* child2;
-  int split_axis;
-  double split_value;
-  std::vector<Photon> photons;
-  int depth;
-  std::mutex m;
+  // the tree: either the built photons or the mapped file
+  const CompactPhoton *data;
+  int num_photons;
+  std::vector<CompactPhoton> photons;
+  MappedFile file;
 };
 
 #endif
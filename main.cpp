@@ -12,8 +12,9 @@
 #include <GL/glu.h>
 #endif
 
-#include "MersenneTwister.h"
 #include "argparser.h"
+#include "image.h"
+#include "tile_renderer.h"
 #include "glCanvas.h"
 #include "mesh.h"
 #include "radiosity.h"
@@ -23,17 +24,31 @@
 
 // =========================================
 // =========================================
+// headless rendering: trace the whole image on all cores (no OpenGL
+// context needed) and write it to args->output_file
 
-MTRand GLOBAL_mtrand;
+void RenderBatch(ArgParser *args, RayTracer *raytracer, PhotonMapping *photon_mapping) {
+  if (args->gather_indirect) {
+    photon_mapping->TracePhotons();
+  }
+  Image image;
+  TileRenderer renderer(raytracer,args);
+  renderer.Render(image);
+  if (!image.Save(args->output_file)) exit(1);
+  printf ("wrote %s\n", args->output_file);
+}
+
+// =========================================
+// =========================================
 
 int main(int argc, char *argv[]) {
   
-  // deterministic (repeatable) randomness
-  // (comment out for "real" randomness)
-  GLOBAL_mtrand = MTRand(37);
-
   ArgParser *args = new ArgParser(argc, argv);
-  glutInit(&argc, argv);
+  if (!args->batch) glutInit(&argc, argv);
+  if (!TriangleBuffer::setKernel(args->triangle_kernel)) {
+    printf ("this CPU does not support the requested triangle kernel\n");
+    exit(1);
+  }
 
   Mesh *mesh = new Mesh();
   mesh->Load(args->input_file,args);
@@ -47,6 +62,21 @@ int main(int argc, char *argv[]) {
   photon_mapping->setRayTracer(raytracer);
   photon_mapping->setRadiosity(radiosity);
 
+  if (args->batch) {
+    if (args->coverage_report != NULL) {
+      photon_mapping->TracePhotons();
+      if (!photon_mapping->WriteCoverageReport(args->coverage_report)) exit(1);
+    } else {
+      RenderBatch(args,raytracer,photon_mapping);
+    }
+    delete photon_mapping;
+    delete radiosity;
+    delete raytracer;
+    delete mesh;
+    delete args;
+    return 0;
+  }
+
   GLCanvas glcanvas;
   glcanvas.initialize(args,mesh,raytracer,radiosity,photon_mapping); 
 
@@ -0,0 +1,53 @@
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mapped_file.h"
+
+// ====================================================================
+
+bool MappedFile::Open(const std::string &filename) {
+  Close();
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    printf ("ERROR! CANNOT OPEN %s: %s\n", filename.c_str(), strerror(errno));
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd,&st) != 0) {
+    printf ("ERROR! CANNOT STAT %s: %s\n", filename.c_str(), strerror(errno));
+    close(fd);
+    return false;
+  }
+  length = st.st_size;
+  if (length == 0) {
+    // mmap can't map nothing
+    data = "";
+    mapped = false;
+  } else {
+    void *p = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+      printf ("ERROR! CANNOT MAP %s: %s\n", filename.c_str(), strerror(errno));
+      close(fd);
+      length = 0;
+      return false;
+    }
+    data = (const char*)p;
+    mapped = true;
+  }
+  // the mapping keeps the file alive
+  close(fd);
+  return true;
+}
+
+void MappedFile::Close() {
+  if (mapped) munmap((void*)data, length);
+  data = NULL;
+  length = 0;
+  mapped = false;
+}
+
+// ====================================================================
@@ -0,0 +1,46 @@
+#ifndef _MAPPED_FILE_H_
+#define _MAPPED_FILE_H_
+
+#include <cstddef>
+#include <string>
+
+// ====================================================================
+// A read only view of a whole file, mapped into memory: nothing is
+// copied, the OS reads the pages the first time they are touched.
+// The data stays valid until the file is closed (or the object is
+// destroyed).
+// ====================================================================
+
+class MappedFile {
+
+public:
+
+  // CONSTRUCTOR & DESTRUCTOR
+  MappedFile() : data(NULL), length(0), mapped(false) {}
+  ~MappedFile() { Close(); }
+
+  // ACCESSORS
+  bool isOpen() const { return data != NULL; }
+  const char* getData() const { return data; }
+  size_t size() const { return length; }
+
+  // MODIFIERS
+  // returns false (and prints why) if the file can't be read
+  bool Open(const std::string &filename);
+  void Close();
+
+private:
+
+  // don't copy (the mapping would be unmapped twice)
+  MappedFile(const MappedFile&);
+  MappedFile& operator=(const MappedFile&);
+
+  // REPRESENTATION
+  const char *data;
+  size_t length;
+  bool mapped;  // (an empty file has nothing to map)
+};
+
+// ====================================================================
+
+#endif
@@ -11,8 +11,9 @@
 #endif
 
 #include <iostream>
-#include <fstream>
+#include <sstream>
 #include <cassert>
+#include <ctime>
 #include <string>
 #include <utility>
 #include "vertex.h"
@@ -27,34 +28,31 @@
 #include "ray.h"
 #include "hit.h"
 #include "camera.h"
+#include "mapped_file.h"
+#include "obj_tokenizer.h"
+#include "scene_cache.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 // =======================================================================
-// DESTRUCTOR
+// CONSTRUCTOR & DESTRUCTOR
 // =======================================================================
 
+Mesh::Mesh() {
+    bbox = NULL;
+    scene_cache = NULL;
+    source_hash = 0;
+}
+
 Mesh::~Mesh() {
+    // (the vertices, edges & faces go with their pools)
     unsigned int i;
-    for (i = 0; i < rasterized_primitive_faces.size(); i++) {
-        Face *f = rasterized_primitive_faces[i];
-        removeFaceEdges(f);
-        delete f;
-    }
-    if (subdivided_quads.size() != original_quads.size()) {
-        for (i = 0; i < subdivided_quads.size(); i++) {
-            Face *f = subdivided_quads[i];
-            removeFaceEdges(f);
-            delete f;
-        }
-    }
-    for (i = 0; i < original_quads.size(); i++) {
-        Face *f = original_quads[i];
-        removeFaceEdges(f);
-        delete f;
-    }
     for (i = 0; i < primitives.size(); i++) { delete primitives[i]; }
     for (i = 0; i < materials.size(); i++) { delete materials[i]; }
-    for (i = 0; i < vertices.size(); i++) { delete vertices[i]; }
     delete bbox;
+    delete scene_cache;
 }
 
 // =======================================================================
@@ -62,14 +60,23 @@ Mesh::~Mesh() {
 // =======================================================================
 
 Vertex* Mesh::addVertex(const Vec3f &position) {
-    int index = numVertices();
-    vertices.push_back(new Vertex(index,position));
+    // (vertices are never removed, so the handle is the next index)
+    int index = vertex_pool.Allocate();
+    assert (index == numVertices()-1);
+    Vertex *v = new (vertex_pool.get(index)) Vertex(index,position);
     // extend the bounding box to include this point
     if (bbox == NULL) 
         bbox = new BoundingBox(position,position);
     else 
         bbox->Extend(position);
-    return vertices[index];
+    return v;
+}
+
+void Mesh::Reserve(int num_new_vertices, int num_new_quads) {
+    vertex_pool.reserve(numVertices() + num_new_vertices);
+    face_pool.reserve(face_pool.size() + num_new_quads);
+    edge_pool.reserve(edge_pool.size() + 4*num_new_quads);
+    edges.reserve(edges.size() + 4*num_new_quads);
 }
 
 void Mesh::addPrimitive(Primitive* p) {
@@ -79,12 +86,17 @@ void Mesh::addPrimitive(Primitive* p) {
 
 void Mesh::addFace(Vertex *a, Vertex *b, Vertex *c, Vertex *d, Material *material, enum FACE_TYPE face_type) {
     // create the face
-    Face *f = new Face(material);
+    unsigned int h = face_pool.Allocate();
+    Face *f = new (face_pool.get(h)) Face(h,material);
     // create the edges
-    Edge *ea = new Edge(a,b,f);
-    Edge *eb = new Edge(b,c,f);
-    Edge *ec = new Edge(c,d,f);
-    Edge *ed = new Edge(d,a,f);
+    unsigned int ha = edge_pool.Allocate();
+    unsigned int hb = edge_pool.Allocate();
+    unsigned int hc = edge_pool.Allocate();
+    unsigned int hd = edge_pool.Allocate();
+    Edge *ea = new (edge_pool.get(ha)) Edge(ha,a,b,f);
+    Edge *eb = new (edge_pool.get(hb)) Edge(hb,b,c,f);
+    Edge *ec = new (edge_pool.get(hc)) Edge(hc,c,d,f);
+    Edge *ed = new (edge_pool.get(hd)) Edge(hd,d,a,f);
     // point the face to one of its edges
     f->setEdge(ea);
     // connect the edges to each other
@@ -92,26 +104,22 @@ void Mesh::addFace(Vertex *a, Vertex *b, Vertex *c, Vertex *d, Material *materia
     eb->setNext(ec);
     ec->setNext(ed);
     ed->setNext(ea);
-    // verify these edges aren't already in the mesh 
-    // (which would be a bug, or a non-manifold mesh)
-    assert (edges.find(std::make_pair(a,b)) == edges.end());
-    assert (edges.find(std::make_pair(b,c)) == edges.end());
-    assert (edges.find(std::make_pair(c,d)) == edges.end());
-    assert (edges.find(std::make_pair(d,a)) == edges.end());
     // add the edges to the master list
-    edges[std::make_pair(a,b)] = ea;
-    edges[std::make_pair(b,c)] = eb;
-    edges[std::make_pair(c,d)] = ec;
-    edges[std::make_pair(d,a)] = ed;
+    // (insert verifies these edges aren't already in the mesh, which
+    // would be a bug, or a non-manifold mesh)
+    edges.insert(a->getIndex(),b->getIndex(),ha);
+    edges.insert(b->getIndex(),c->getIndex(),hb);
+    edges.insert(c->getIndex(),d->getIndex(),hc);
+    edges.insert(d->getIndex(),a->getIndex(),hd);
     // connect up with opposite edges (if they exist)
-    edgeshashtype::iterator ea_op = edges.find(std::make_pair(b,a)); 
-    edgeshashtype::iterator eb_op = edges.find(std::make_pair(c,b)); 
-    edgeshashtype::iterator ec_op = edges.find(std::make_pair(d,c)); 
-    edgeshashtype::iterator ed_op = edges.find(std::make_pair(a,d)); 
-    if (ea_op != edges.end()) { ea_op->second->setOpposite(ea); }
-    if (eb_op != edges.end()) { eb_op->second->setOpposite(eb); }
-    if (ec_op != edges.end()) { ec_op->second->setOpposite(ec); }
-    if (ed_op != edges.end()) { ed_op->second->setOpposite(ed); }
+    Edge *ea_op = getEdge(b,a);
+    Edge *eb_op = getEdge(c,b);
+    Edge *ec_op = getEdge(d,c);
+    Edge *ed_op = getEdge(a,d);
+    if (ea_op != NULL) { ea_op->setOpposite(ea); }
+    if (eb_op != NULL) { eb_op->setOpposite(eb); }
+    if (ec_op != NULL) { ec_op->setOpposite(ec); }
+    if (ed_op != NULL) { ed_op->setOpposite(ed); }
     // add the face to the appropriate master list
     if (face_type == FACE_TYPE_ORIGINAL) {
         original_quads.push_back(f);
@@ -128,8 +136,7 @@ void Mesh::addFace(Vertex *a, Vertex *b, Vertex *c, Vertex *d, Material *materia
     }
 }
 
-void Mesh::removeFaceEdges(Face *f) {
-    // helper function for face deletion
+void Mesh::removeFace(Face *f) {
     Edge *ea = f->getEdge();
     Edge *eb = ea->getNext();
     Edge *ec = eb->getNext();
@@ -140,24 +147,25 @@ void Mesh::removeFaceEdges(Face *f) {
     Vertex *c = ec->getStartVertex();
     Vertex *d = ed->getStartVertex();
     // remove elements from master lists
-    edges.erase(std::make_pair(a,b)); 
-    edges.erase(std::make_pair(b,c)); 
-    edges.erase(std::make_pair(c,d)); 
-    edges.erase(std::make_pair(d,a)); 
+    edges.erase(a->getIndex(),b->getIndex());
+    edges.erase(b->getIndex(),c->getIndex());
+    edges.erase(c->getIndex(),d->getIndex());
+    edges.erase(d->getIndex(),a->getIndex());
     // clean up memory
-    delete ea;
-    delete eb;
-    delete ec;
-    delete ed;
+    edge_pool.Free(ea->getHandle());
+    edge_pool.Free(eb->getHandle());
+    edge_pool.Free(ec->getHandle());
+    edge_pool.Free(ed->getHandle());
+    face_pool.Free(f->getHandle());
 }
 
 // ==============================================================================
 // EDGE HELPER FUNCTIONS
 
 Edge* Mesh::getEdge(Vertex *a, Vertex *b) const {
-    edgeshashtype::const_iterator iter = edges.find(std::make_pair(a,b));
-    if (iter == edges.end()) return NULL;
-    return iter->second;
+    unsigned int h = edges.find(a->getIndex(),b->getIndex());
+    if (h == EDGE_HASH_NONE) return NULL;
+    return edge_pool.get(h);
 }
 
 Vertex* Mesh::getChildVertex(Vertex *p1, Vertex *p2) const {
@@ -176,106 +184,165 @@ void Mesh::setParentsChild(Vertex *p1, Vertex *p2, Vertex *child) {
 // the load function parses our (non-standard) extension of very simple .obj files
 // ===============================================================================
 
+// wall clock seconds (for the load timings)
+static double Seconds() {
+#ifdef _OPENMP
+    return omp_get_wtime();
+#else
+    return clock() / (double)CLOCKS_PER_SEC;
+#endif
+}
+
+// read the next n numbers of the .obj file into the record
+static void ReadValues(ObjTokenizer &tokens, SceneRecord &r, enum SCENE_RECORD_TYPE type, int n) {
+    r.type = type;
+    r.num_values = n;
+    for (int i = 0; i < n; i++) { r.values[i] = tokens.readDouble(); }
+}
+
+// add the record to the mesh, timing the quads & primitives
+void Mesh::TimedApplyRecord(const SceneRecord &r, Material *&active_material,
+                            double &quads_time, double &primitives_time) {
+    if (r.type == SCENE_QUAD) {
+        double t = Seconds();
+        ApplyRecord(r,active_material);
+        quads_time += Seconds() - t;
+    } else if (r.type == SCENE_SPHERE || r.type == SCENE_CYLINDER_RING) {
+        double t = Seconds();
+        ApplyRecord(r,active_material);
+        primitives_time += Seconds() - t;
+    } else {
+        ApplyRecord(r,active_material);
+    }
+}
+
 void Mesh::Load(const std::string &input_file, ArgParser *_args) {
     args = _args;
-    std::ifstream objfile(input_file.c_str());
-    if (objfile == NULL) {
-        std::cout << "ERROR! CANNOT OPEN " << input_file << std::endl;
-        return;
+    double start_time = Seconds();
+    MappedFile objfile;
+    if (!objfile.Open(input_file)) return;
+    const char *text = objfile.getData();
+    const char *text_end = text + objfile.size();
+    source_hash = SceneCache::Hash(text,objfile.size());
+    delete scene_cache;
+    scene_cache = NULL;
+    if (args->scene_cache) {
+        scene_cache = new SceneCache(input_file,objfile.size(),source_hash,args);
     }
+    double mapped_time = Seconds();
     
-    std::string token;
     Material *active_material = NULL;
     camera = NULL;
     background_color = Vec3f(1,1,1);
+    // (time spent building the half edges of the quads & rasterizing
+    // the primitives, part of the parse)
+    double quads_time = 0;
+    double primitives_time = 0;
+    double counted_time = 0;
+    SceneRecord r;
+    bool from_cache = (scene_cache != NULL && scene_cache->Open());
     
-    while (objfile >> token) {
-    begin:
-        if (token == "v") {
-            double x,y,z;
-            objfile >> x >> y >> z;
-            addVertex(Vec3f(x,y,z));
-        } else if (token == "vt") {
-            assert (numVertices() >= 1);
-            double s,t;
-            objfile >> s >> t;
-            getVertex(numVertices()-1)->setTextureCoordinates(s,t);
-        } else if (token == "f") {
-            int a,b,c,d;
-            objfile >> a >> b >> c >> d;
-            a--;
-            b--;
-            c--;
-            d--;
-            assert (a >= 0 && a < numVertices());
-            assert (b >= 0 && b < numVertices());
-            assert (c >= 0 && c < numVertices());
-            assert (d >= 0 && d < numVertices());
-            assert (active_material != NULL);
-            addOriginalQuad(getVertex(a),getVertex(b),getVertex(c),getVertex(d),active_material);
-        } else if (token == "s") {
-            double x,y,z,r;
-            objfile >> x >> y >> z >> r;
-            assert (active_material != NULL);
-            addPrimitive(new Sphere(Vec3f(x,y,z),r,active_material));
-        } else if (token == "r") {
-            double x,y,z,h,r,r2;
-            objfile >> x >> y >> z >> h >> r >> r2;
-            assert (active_material != NULL);
-            addPrimitive(new CylinderRing(Vec3f(x,y,z),h,r,r2,active_material));
-        } else if (token == "background_color") {
-            double r,g,b;
-            objfile >> r >> g >> b;
-            background_color = Vec3f(r,g,b);
-        } else if (token == "PerspectiveCamera") {
-            camera = new PerspectiveCamera();
-            objfile >> *(PerspectiveCamera*)camera;
-        } else if (token == "OrthographicCamera") {
-            camera = new OrthographicCamera();
-            objfile >> *(OrthographicCamera*)camera;
-        } else if (token == "m") {
-            // this is not standard .obj format!!
-            // materials
-            int m;
-            objfile >> m;
-            assert (m >= 0 && m < (int)materials.size());
-            active_material = materials[m];
-        } else if (token == "material") {
-            // this is not standard .obj format!!
-            std::string texture_file = "";
-            Vec3f diffuse(0,0,0);
-            double r,g,b;
-            objfile >> token;
-            if (token == "diffuse") {
-                objfile >> r >> g >> b;
-                diffuse = Vec3f(r,g,b);
+    if (from_cache) {
+        // replay the records of the (unchanged) file
+        objfile.Close();
+        Reserve(scene_cache->numVertices(),scene_cache->numQuads());
+        original_quads.reserve(original_quads.size() + scene_cache->numQuads());
+        subdivided_quads.reserve(subdivided_quads.size() + scene_cache->numQuads());
+        while (scene_cache->Read(r)) {
+            TimedApplyRecord(r,active_material,quads_time,primitives_time);
+        }
+    } else {
+        // a quick first pass over the lines, to allocate the vertices & quads once
+        int num_v, num_f;
+        ObjTokenizer::CountVerticesAndFaces(text,text_end,num_v,num_f);
+        Reserve(num_v,num_f);
+        original_quads.reserve(original_quads.size() + num_f);
+        subdivided_quads.reserve(subdivided_quads.size() + num_f);
+        counted_time = Seconds();
+        
+        // parse each statement into a record, which is saved to the
+        // cache & added to the mesh
+        ObjTokenizer tokens(text,text_end);
+        while (tokens.Next()) {
+        begin:
+            // the material statement reads one token too many
+            bool more = false;
+            if (tokens.Is("v")) {
+                ReadValues(tokens,r,SCENE_VERTEX,3);
+            } else if (tokens.Is("vt")) {
+                ReadValues(tokens,r,SCENE_TEXTURE_COORDINATES,2);
+            } else if (tokens.Is("f")) {
+                r.type = SCENE_QUAD;
+                r.num_values = 4;
+                for (int i = 0; i < 4; i++) { r.values[i] = tokens.readInt() - 1; }
+            } else if (tokens.Is("s")) {
+                ReadValues(tokens,r,SCENE_SPHERE,4);
+            } else if (tokens.Is("r")) {
+                ReadValues(tokens,r,SCENE_CYLINDER_RING,6);
+            } else if (tokens.Is("background_color")) {
+                ReadValues(tokens,r,SCENE_BACKGROUND_COLOR,3);
+            } else if (tokens.Is("PerspectiveCamera") || tokens.Is("OrthographicCamera")) {
+                // the cameras read themselves from a stream: keep the
+                // text of the block { ... }
+                r.type = SCENE_CAMERA;
+                r.num_values = 1;
+                r.values[0] = tokens.Is("PerspectiveCamera");
+                const char *block = tokens.getPosition();
+                while (tokens.Next() && !tokens.Is("}")) {}
+                r.text.assign(block,tokens.getPosition());
+            } else if (tokens.Is("m")) {
+                // this is not standard .obj format!!
+                // materials
+                r.type = SCENE_SELECT_MATERIAL;
+                r.num_values = 1;
+                r.values[0] = tokens.readInt();
+            } else if (tokens.Is("material")) {
+                // this is not standard .obj format!!
+                // diffuse, reflective, emitted & transmitted colors and the texture file
+                r.type = SCENE_MATERIAL;
+                r.num_values = 12;
+                for (int i = 0; i < 12; i++) { r.values[i] = 0; }
+                r.text = "";
+                tokens.Next();
+                if (tokens.Is("diffuse")) {
+                    for (int i = 0; i < 3; i++) { r.values[i] = tokens.readDouble(); }
+                } else {
+                    assert (tokens.Is("texture_file"));
+                    r.text = tokens.readString();
+                }
+                tokens.Next();
+                assert (tokens.Is("reflective"));
+                for (int i = 3; i < 6; i++) { r.values[i] = tokens.readDouble(); }
+                tokens.Next();
+                assert (tokens.Is("emitted"));
+                for (int i = 6; i < 9; i++) { r.values[i] = tokens.readDouble(); }
+                more = tokens.Next();
+                if (more && tokens.Is("transmitted")) {
+                    for (int i = 9; i < 12; i++) { r.values[i] = tokens.readDouble(); }
+                    more = false;
+                }
             } else {
-                assert (token == "texture_file");
-                objfile >> texture_file;
-            }
-            Vec3f reflective,emitted,transmitted;      
-            objfile >> token >> r >> g >> b;
-            assert (token == "reflective");
-            reflective = Vec3f(r,g,b);
-            objfile >> token >> r >> g >> b;
-            assert (token == "emitted");
-            emitted = Vec3f(r,g,b);
-            objfile >> token;
-            if (token == "transmitted") {
-                objfile >> r >> g >> b;
-                transmitted = Vec3f(r,g,b);
-                materials.push_back(new Material(texture_file,diffuse,reflective,emitted,transmitted));
-            }
-            else {
-                materials.push_back(new Material(texture_file,diffuse,reflective,emitted,transmitted));
-                goto begin;
+                std::cout << "UNKNOWN TOKEN " << tokens.getToken() << std::endl;
+                exit(0);
             }
-        } else {
-            std::cout << "UNKNOWN TOKEN " << token << std::endl;
-            exit(0);
+            if (scene_cache != NULL) scene_cache->Write(r);
+            TimedApplyRecord(r,active_material,quads_time,primitives_time);
+            if (more) goto begin;
         }
+        // (the cache file is written once, by the BVH, when its tree
+        // has been added)
     }
+    double parsed_time = Seconds();
     std::cout << " mesh loaded " << numFaces() << std::endl;
+    if (from_cache) {
+        printf (" load %.1f ms: map & hash %.1f, read cache %.1f, build quads %.1f, rasterize primitives %.1f\n",
+                1000*(parsed_time-start_time), 1000*(mapped_time-start_time),
+                1000*(parsed_time-mapped_time-quads_time-primitives_time), 1000*quads_time, 1000*primitives_time);
+    } else {
+        printf (" load %.1f ms: map & hash %.1f, count %.1f, parse %.1f, build quads %.1f, rasterize primitives %.1f\n",
+                1000*(parsed_time-start_time), 1000*(mapped_time-start_time), 1000*(counted_time-mapped_time),
+                1000*(parsed_time-counted_time-quads_time-primitives_time), 1000*quads_time, 1000*primitives_time);
+    }
     
     if (camera == NULL) {
         // if not initialized, position a perspective camera and scale it so it fits in the window
@@ -288,6 +355,62 @@ void Mesh::Load(const std::string &input_file, ArgParser *_args) {
     }
 }
 
+// =======================================================================
+
+void Mesh::ApplyRecord(const SceneRecord &r, Material *&active_material) {
+    const double *v = r.values;
+    switch (r.type) {
+    case SCENE_VERTEX:
+        addVertex(Vec3f(v[0],v[1],v[2]));
+        break;
+    case SCENE_TEXTURE_COORDINATES:
+        assert (numVertices() >= 1);
+        getVertex(numVertices()-1)->setTextureCoordinates(v[0],v[1]);
+        break;
+    case SCENE_QUAD: {
+        int a = (int)v[0], b = (int)v[1], c = (int)v[2], d = (int)v[3];
+        assert (a >= 0 && a < numVertices());
+        assert (b >= 0 && b < numVertices());
+        assert (c >= 0 && c < numVertices());
+        assert (d >= 0 && d < numVertices());
+        assert (active_material != NULL);
+        addOriginalQuad(getVertex(a),getVertex(b),getVertex(c),getVertex(d),active_material);
+        break; }
+    case SCENE_SPHERE:
+        assert (active_material != NULL);
+        addPrimitive(new Sphere(Vec3f(v[0],v[1],v[2]),v[3],active_material));
+        break;
+    case SCENE_CYLINDER_RING:
+        assert (active_material != NULL);
+        addPrimitive(new CylinderRing(Vec3f(v[0],v[1],v[2]),v[3],v[4],v[5],active_material));
+        break;
+    case SCENE_BACKGROUND_COLOR:
+        background_color = Vec3f(v[0],v[1],v[2]);
+        break;
+    case SCENE_CAMERA: {
+        std::istringstream camera_text(r.text);
+        if (v[0] != 0) {
+            camera = new PerspectiveCamera();
+            camera_text >> *(PerspectiveCamera*)camera;
+        } else {
+            camera = new OrthographicCamera();
+            camera_text >> *(OrthographicCamera*)camera;
+        }
+        break; }
+    case SCENE_SELECT_MATERIAL: {
+        int m = (int)v[0];
+        assert (m >= 0 && m < (int)materials.size());
+        active_material = materials[m];
+        break; }
+    case SCENE_MATERIAL:
+        materials.push_back(new Material(r.text,Vec3f(v[0],v[1],v[2]),Vec3f(v[3],v[4],v[5]),
+                                         Vec3f(v[6],v[7],v[8]),Vec3f(v[9],v[10],v[11])));
+        break;
+    default:
+        assert (0);
+    }
+}
+
 
 // =======================================================================
 // PAINT
@@ -301,9 +424,10 @@ void Mesh::PaintWireframe() {
     glLineWidth(1);
     glColor3f(0,0,0);
     glBegin (GL_LINES);
-    for (edgeshashtype::iterator iter = edges.begin();
-         iter != edges.end(); iter++) {
-        Edge *e = iter->second;
+    for (int i = 0; i < edges.numSlots(); i++) {
+        unsigned int h = edges.getSlotEdge(i);
+        if (h == EDGE_HASH_NONE) continue;
+        Edge *e = edge_pool.get(h);
         if (e->getOpposite() == NULL) continue;
         Vec3f a = e->getStartVertex()->get();
         Vec3f b = e->getEndVertex()->get();
@@ -316,9 +440,10 @@ void Mesh::PaintWireframe() {
     glLineWidth(3);
     glColor3f(1,0,0);
     glBegin (GL_LINES);
-    for (edgeshashtype::iterator iter = edges.begin();
-         iter != edges.end(); iter++) {
-        Edge *e = iter->second;
+    for (int i = 0; i < edges.numSlots(); i++) {
+        unsigned int h = edges.getSlotEdge(i);
+        if (h == EDGE_HASH_NONE) continue;
+        Edge *e = edge_pool.get(h);
         if (e->getOpposite() != NULL) continue;
         Vec3f a = e->getStartVertex()->get();
         Vec3f b = e->getEndVertex()->get();
@@ -366,6 +491,10 @@ void Mesh::Subdivision() {
     
     std::vector<Face*> tmp = subdivided_quads;
     subdivided_quads.clear();
+    // each quad becomes 4, with 5 new vertices (the edge vertices are
+    // shared, so that's an upper bound)
+    Reserve(5*tmp.size(),4*tmp.size());
+    subdivided_quads.reserve(4*tmp.size());
     
     for (unsigned int i = 0; i < tmp.size(); i++) {
         Face *f = tmp[i];
@@ -390,8 +519,7 @@ void Mesh::Subdivision() {
         // copy the color and emission from the old patch to the new
         Material *material = f->getMaterial();
         if (!first_subdivision) {
-            removeFaceEdges(f);
-            delete f;
+            removeFace(f);
         }
         
         // create the new faces
@@ -4,6 +4,8 @@
 #include <vector>
 #include "vectors.h"
 #include "hash.h"
+#include "object_pool.h"
+#include "vertex.h"
 
 class Vertex;
 class Edge;
@@ -15,6 +17,8 @@ class ArgParser;
 class Camera;
 class Ray;
 class Hit;
+class SceneCache;
+class SceneRecord;
 
 enum FACE_TYPE { FACE_TYPE_ORIGINAL, FACE_TYPE_RASTERIZED, FACE_TYPE_SUBDIVIDED };
 
@@ -31,18 +35,18 @@ public:
 
   // ===============================
   // CONSTRUCTOR & DESTRUCTOR & LOAD
-  Mesh() { bbox = NULL; }
+  Mesh();
   virtual ~Mesh();
   void Load(const std::string &input_file, ArgParser *_args);
     
   // ========
   // VERTICES
-  int numVertices() const { return vertices.size(); }
+  int numVertices() const { return vertex_pool.size(); }
   Vertex* addVertex(const Vec3f &pos);
   // look up vertex by index from original .obj file
   Vertex* getVertex(int i) const {
     assert (i >= 0 && i < numVertices());
-    return vertices[i]; }
+    return vertex_pool.get(i); }
   // this creates a relationship between 3 vertices (2 parents, 1 child)
   void setParentsChild(Vertex *p1, Vertex *p2, Vertex *child);
   // this accessor will find a child vertex (if it exists) when given
@@ -101,6 +105,10 @@ public:
   BoundingBox* getBoundingBox() const { assert (bbox != NULL); return bbox; }
   const Vec3f& getBackgroundColor() const { return background_color; }
   Camera* getCamera() const { assert (camera != NULL); return camera; }
+  // the binary cache of the input file (NULL if -no_scene_cache)
+  SceneCache* getSceneCache() const { return scene_cache; }
+  // the hash of the text of the input file (identifies the scene)
+  unsigned long long getSourceHash() const { return source_hash; }
 
   // ===============
   // OTHER FUNCTIONS
@@ -114,8 +122,14 @@ private:
   Vertex* AddEdgeVertex(Vertex *a, Vertex *b);
   Vertex* AddMidVertex(Vertex *a, Vertex *b, Vertex *c, Vertex *d);
   void addFace(Vertex *a, Vertex *b, Vertex *c, Vertex *d, Material *material, enum FACE_TYPE face_type);
-  void removeFaceEdges(Face *f);
+  void removeFace(Face *f);
+  // make room for this many more vertices & quads
+  void Reserve(int num_new_vertices, int num_new_quads);
   void addPrimitive(Primitive *p); 
+  // add one statement of the .obj file (parsed or from the cache)
+  void ApplyRecord(const SceneRecord &r, Material *&active_material);
+  void TimedApplyRecord(const SceneRecord &r, Material *&active_material,
+                        double &quads_time, double &primitives_time);
 
   // ==============
   // REPRESENTATION
@@ -123,13 +137,19 @@ private:
   std::vector<Material*> materials;
   Vec3f background_color;
   Camera *camera;
+  SceneCache *scene_cache;
+  unsigned long long source_hash;
 
   // the bounding box of all rasterized faces in the scene
   BoundingBox *bbox; 
 
-  // the vertices & edges used by all quads (including rasterized primitives)
-  std::vector<Vertex*> vertices;  
-  edgeshashtype edges;
+  // the vertices, edges & faces of all quads (including rasterized
+  // primitives).  The handle of a vertex is its index.
+  ObjectPool<Vertex> vertex_pool;
+  ObjectPool<Edge> edge_pool;
+  ObjectPool<Face> face_pool;
+  // the edges, by the indices of their vertices
+  EdgeHashTable edges;
   vphashtype vertex_parents;
 
   // the quads from the .obj file (before subdivision)
@@ -0,0 +1,115 @@
+#include <cstdlib>
+#include "obj_tokenizer.h"
+
+// the powers of ten that are exact doubles
+static const double exact_powers_of_ten[] = {
+  1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+// ====================================================================
+
+double ObjTokenizer::readDouble() {
+  bool ok = Next();
+  assert (ok);
+  const char *p = token;
+  const char *e = token + token_length;
+
+  // the common case (a plain decimal number with few digits) is
+  // <mantissa> * 10^<exponent>, with a mantissa that fits in the 53
+  // bits of a double and an exact power of ten.  One multiplication
+  // or division of two exact values is correctly rounded, which is
+  // what strtod (and >>) gives.
+  bool negative = false;
+  if (p < e && (*p == '-' || *p == '+')) {
+    negative = (*p == '-');
+    p++;
+  }
+  unsigned long long mantissa = 0;
+  int exponent = 0;
+  int num_digits = 0;
+  bool exact = true;
+  for ( ; p < e && *p >= '0' && *p <= '9'; p++) {
+    if (mantissa >= (1ULL << 53) / 10) exact = false;
+    mantissa = 10*mantissa + (*p - '0');
+    num_digits++;
+  }
+  if (p < e && *p == '.') {
+    for (p++; p < e && *p >= '0' && *p <= '9'; p++) {
+      if (mantissa >= (1ULL << 53) / 10) exact = false;
+      mantissa = 10*mantissa + (*p - '0');
+      exponent--;
+      num_digits++;
+    }
+  }
+  if (p < e && (*p == 'e' || *p == 'E')) {
+    p++;
+    bool negative_exponent = false;
+    if (p < e && (*p == '-' || *p == '+')) {
+      negative_exponent = (*p == '-');
+      p++;
+    }
+    if (p == e) exact = false;
+    int n = 0;
+    for ( ; p < e && *p >= '0' && *p <= '9'; p++) {
+      if (n < 10000) n = 10*n + (*p - '0');
+    }
+    exponent += negative_exponent ? -n : n;
+  }
+  if (exact && num_digits > 0 && p == e &&
+      exponent >= -22 && exponent <= 22) {
+    double x = (double)mantissa;
+    if (exponent < 0) x /= exact_powers_of_ten[-exponent];
+    else x *= exact_powers_of_ten[exponent];
+    return negative ? -x : x;
+  }
+
+  // anything else (many digits, huge exponents, inf, ...): let strtod
+  // do it, on a terminated copy
+  std::string copy = getToken();
+  char *stop;
+  double x = strtod(copy.c_str(),&stop);
+  assert (*stop == '\0');
+  return x;
+}
+
+int ObjTokenizer::readInt() {
+  bool ok = Next();
+  assert (ok);
+  const char *p = token;
+  const char *e = token + token_length;
+  bool negative = false;
+  if (p < e && (*p == '-' || *p == '+')) {
+    negative = (*p == '-');
+    p++;
+  }
+  assert (p < e);
+  int n = 0;
+  for ( ; p < e; p++) {
+    assert (*p >= '0' && *p <= '9');
+    n = 10*n + (*p - '0');
+  }
+  return negative ? -n : n;
+}
+
+// ====================================================================
+
+void ObjTokenizer::CountVerticesAndFaces(const char *begin, const char *end,
+                                         int &num_vertices, int &num_faces) {
+  num_vertices = 0;
+  num_faces = 0;
+  const char *p = begin;
+  while (p < end) {
+    // the first token of the line
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    if (p+1 < end && IsSpace(p[1])) {
+      if (p[0] == 'v') num_vertices++;
+      else if (p[0] == 'f') num_faces++;
+    }
+    // skip to the next line
+    const char *eol = (const char*)memchr(p,'\n',end-p);
+    if (eol == NULL) break;
+    p = eol+1;
+  }
+}
+
+// ====================================================================
@@ -0,0 +1,70 @@
+#ifndef _OBJ_TOKENIZER_H_
+#define _OBJ_TOKENIZER_H_
+
+#include <cassert>
+#include <cstring>
+#include <string>
+
+// ====================================================================
+// Splits the text of an .obj file (in memory, e.g. a MappedFile) into
+// whitespace separated tokens, the same tokens that reading the file
+// with std::ifstream >> would give, but without copying them: the
+// current token is just a pointer & a length into the text.  The
+// numbers are parsed in place, and they come out bit for bit the same
+// as reading them with >>.
+// ====================================================================
+
+class ObjTokenizer {
+
+public:
+
+  // CONSTRUCTOR
+  ObjTokenizer(const char *begin, const char *end) :
+    next(begin), end(end), token(begin), token_length(0) {}
+
+  // ACCESSORS
+  // the current token
+  bool Is(const char *s) const {
+    return strncmp(token,s,token_length) == 0 && s[token_length] == '\0'; }
+  std::string getToken() const { return std::string(token,token_length); }
+  // where the current token starts & where the next one will be looked for
+  const char* getTokenStart() const { return token; }
+  const char* getPosition() const { return next; }
+
+  // MODIFIERS
+  // move to the next token, false at the end of the text
+  bool Next() {
+    while (next < end && IsSpace(*next)) next++;
+    if (next == end) { token_length = 0; return false; }
+    token = next;
+    while (next < end && !IsSpace(*next)) next++;
+    token_length = next - token;
+    return true; }
+  // the next token as a number (asserts that there is one)
+  double readDouble();
+  int readInt();
+  std::string readString() {
+    bool ok = Next();
+    assert (ok);
+    return getToken(); }
+
+  // (for pre-sizing) count the lines that start with the token "v" and
+  // the lines that start with "f", without tokenizing everything
+  static void CountVerticesAndFaces(const char *begin, const char *end,
+                                    int &num_vertices, int &num_faces);
+
+private:
+
+  static bool IsSpace(char c) {
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t' || c == '\v' || c == '\f'; }
+
+  // REPRESENTATION
+  const char *next;
+  const char *end;
+  const char *token;
+  int token_length;
+};
+
+// ====================================================================
+
+#endif
@@ -0,0 +1,98 @@
+#ifndef _OBJECT_POOL_H_
+#define _OBJECT_POOL_H_
+
+#include <vector>
+#include <new>
+#include <cassert>
+
+// objects per block (a power of 2)
+#define OBJECT_POOL_BLOCK_BITS 12
+#define OBJECT_POOL_BLOCK_SIZE (1 << OBJECT_POOL_BLOCK_BITS)
+
+// ====================================================================
+// Storage for many small objects of one type (the vertices, edges &
+// faces of the mesh).  Instead of a new for each object, the objects
+// are constructed in place in large blocks, and each one is known by
+// a 32 bit handle (its slot).  Blocks never move, so pointers to the
+// objects stay valid until they are freed; the slots of freed objects
+// are reused.  Destroying the pool destroys whatever is left in it.
+//
+//   unsigned int h = pool.Allocate();
+//   Thing *t = new (pool.get(h)) Thing(...);
+//   ...
+//   pool.Free(h);
+// ====================================================================
+
+template <class T> class ObjectPool {
+
+public:
+
+  // CONSTRUCTOR & DESTRUCTOR
+  ObjectPool() : num_objects(0) {}
+  ~ObjectPool() { Clear(); }
+
+  // ACCESSORS
+  // the number of live objects
+  int size() const { return num_objects; }
+  T* get(unsigned int h) const {
+    assert (h < alive.size() && alive[h]);
+    return (T*)blocks[h >> OBJECT_POOL_BLOCK_BITS] + (h & (OBJECT_POOL_BLOCK_SIZE-1)); }
+
+  // MODIFIERS
+  // make room for n objects in all, so they are allocated at once
+  void reserve(unsigned int n) {
+    while (blocks.size() * OBJECT_POOL_BLOCK_SIZE < n) AddBlock();
+    alive.reserve(n); }
+  // a slot for a new object, which must then be constructed in it
+  unsigned int Allocate() {
+    unsigned int h;
+    if (!free_slots.empty()) {
+      h = free_slots.back();
+      free_slots.pop_back();
+    } else {
+      h = alive.size();
+      if (h == blocks.size() * OBJECT_POOL_BLOCK_SIZE) AddBlock();
+      alive.push_back(false);
+    }
+    alive[h] = true;
+    num_objects++;
+    return h; }
+  // destroy the object & give its slot back
+  void Free(unsigned int h) {
+    get(h)->~T();
+    alive[h] = false;
+    free_slots.push_back(h);
+    num_objects--; }
+  // destroy all the objects & release the blocks
+  void Clear() {
+    for (unsigned int h = 0; h < alive.size(); h++) {
+      if (alive[h]) get(h)->~T();
+    }
+    for (unsigned int b = 0; b < blocks.size(); b++) {
+      ::operator delete(blocks[b]);
+    }
+    blocks.clear();
+    alive.clear();
+    free_slots.clear();
+    num_objects = 0; }
+
+private:
+
+  // don't copy (the blocks would be released twice)
+  ObjectPool(const ObjectPool&);
+  ObjectPool& operator=(const ObjectPool&);
+
+  void AddBlock() {
+    blocks.push_back(::operator new(OBJECT_POOL_BLOCK_SIZE * sizeof(T))); }
+
+  // REPRESENTATION
+  std::vector<void*> blocks;
+  // which slots hold an object
+  std::vector<bool> alive;
+  std::vector<unsigned int> free_slots;
+  int num_objects;
+};
+
+// ====================================================================
+
+#endif
@@ -2,6 +2,8 @@
 #define _PHOTON_H_
 
 #include <iostream>
+#include <cmath>
+#include <algorithm>
 #include "vectors.h"
 
 // ===========================================================
@@ -10,7 +12,8 @@
 class Photon {
  public:
 
-  // CONSTRUCTOR
+  // CONSTRUCTORS
+  Photon() : bounce(0) {}
   Photon(const Vec3f &p, const Vec3f &d, const Vec3f &e, int b) :
     position(p),direction_from(d),energy(e),bounce(b) {}
 
@@ -28,4 +31,150 @@ class Photon {
   int bounce;
 };
 
+// ===========================================================
+// Quantized storage for the photon map (20 bytes instead of ~80):
+// float position, RGBE shared-exponent energy, incoming direction
+// packed as spherical coordinates (one byte each for theta & phi),
+// the bounce number and a byte of flags for use by the kdtree.
+// Photon is the decoded view of this record.
+
+class CompactPhoton {
+ public:
+
+  // CONSTRUCTORS
+  CompactPhoton() {
+    position[0] = position[1] = position[2] = 0;
+    energy[0] = energy[1] = energy[2] = energy[3] = 0;
+    theta = phi = 0;
+    bounce = 0;
+    flags = 0; }
+  explicit CompactPhoton(const Photon &p) {
+    const Vec3f &pos = p.getPosition();
+    position[0] = pos.x();
+    position[1] = pos.y();
+    position[2] = pos.z();
+    EncodeEnergy(p.getEnergy());
+    EncodeDirection(p.getDirectionFrom());
+    assert (p.whichBounce() >= 0 && p.whichBounce() < 256);
+    bounce = p.whichBounce();
+    flags = 0; }
+
+  // ACCESSORS
+  Vec3f getPosition() const { return Vec3f(position[0],position[1],position[2]); }
+  float getPosition(int axis) const {
+    assert (axis >= 0 && axis < 3);
+    return position[axis]; }
+  Vec3f getDirectionFrom() const {
+    double t = (theta+0.5) * (M_PI/256.0);
+    double p = (phi+0.5) * (2*M_PI/256.0);
+    return Vec3f(sin(t)*cos(p),sin(t)*sin(p),cos(t)); }
+  Vec3f getEnergy() const {
+    if (energy[3] == 0) return Vec3f(0,0,0);
+    double f = ldexp(1.0,energy[3]-(128+8));
+    return Vec3f((energy[0]+0.5)*f,(energy[1]+0.5)*f,(energy[2]+0.5)*f); }
+  int whichBounce() const { return bounce; }
+  int getFlags() const { return flags; }
+  Photon getPhoton() const {
+    return Photon(getPosition(),getDirectionFrom(),getEnergy(),bounce); }
+
+  // MODIFIERS
+  void setFlags(int f) {
+    assert (f >= 0 && f < 256);
+    flags = f; }
+
+ private:
+
+  // HELPER FUNCTIONS
+  void EncodeEnergy(const Vec3f &e) {
+    // Greg Ward's RGBE: 8 bit mantissas with a shared exponent
+    double v = std::max(e.r(),std::max(e.g(),e.b()));
+    if (v < 1e-32) {
+      energy[0] = energy[1] = energy[2] = energy[3] = 0;
+      return;
+    }
+    int exponent;
+    double scale = frexp(v,&exponent) * 256.0 / v;
+    energy[0] = (unsigned char)(std::max(0.0,e.r()) * scale);
+    energy[1] = (unsigned char)(std::max(0.0,e.g()) * scale);
+    energy[2] = (unsigned char)(std::max(0.0,e.b()) * scale);
+    energy[3] = (unsigned char)(exponent + 128);
+  }
+  void EncodeDirection(const Vec3f &d) {
+    double length = d.Length();
+    if (length == 0) { theta = phi = 0; return; }
+    double z = std::max(-1.0,std::min(1.0,d.z()/length));
+    int t = int(acos(z) * (256.0/M_PI));
+    // (floor, not truncation, so negative angles fall in their own
+    // bin, which wraps around to [0,256))
+    int p = int(floor(atan2(d.y(),d.x()) * (256.0/(2*M_PI))));
+    theta = (unsigned char)std::min(255,t);
+    phi = (unsigned char)(p & 255);
+  }
+
+  // REPRESENTATION
+  float position[3];
+  unsigned char energy[4];
+  unsigned char theta, phi;
+  unsigned char bounce;
+  unsigned char flags;
+};
+
+// ===========================================================
+// Running totals of the photons received by a surface (e.g., a
+// receiver sphere): no photons are stored, so adding one is O(1)
+// and allocation free.  The sum of the squares of what each emitted
+// photon left in total (see AddPhotonTotal) gives the variance of
+// the received power.  The per-bounce histogram lumps everything
+// from MAX_TALLY_BOUNCE on into its last bin.
+
+#define MAX_TALLY_BOUNCE 8
+
+class PhotonTally {
+ public:
+
+  // CONSTRUCTOR
+  PhotonTally() { Clear(); }
+  // (for reading a saved photon map) the totals as they were
+  PhotonTally(int c, const Vec3f &e, double e2, const int *b) :
+    count(c), energy(e), energy_squared(e2) {
+    for (int i = 0; i <= MAX_TALLY_BOUNCE; i++) bounces[i] = b[i]; }
+
+  // ACCESSORS
+  int numPhotons() const { return count; }
+  const Vec3f& getEnergy() const { return energy; }
+  // sum over the emitted photons of the square of the (average)
+  // energy each one left here
+  double getEnergySquared() const { return energy_squared; }
+  int numPhotonsAtBounce(int b) const {
+    assert (b >= 0 && b <= MAX_TALLY_BOUNCE);
+    return bounces[b]; }
+
+  // MODIFIERS
+  void Clear() {
+    count = 0;
+    energy = Vec3f(0,0,0);
+    energy_squared = 0;
+    for (int b = 0; b <= MAX_TALLY_BOUNCE; b++) bounces[b] = 0; }
+  void Add(const Vec3f &e, int bounce) {
+    count++;
+    energy += e;
+    bounces[std::min(std::max(bounce,0),MAX_TALLY_BOUNCE)]++; }
+  // once per emitted photon that got here: the (average) energy it
+  // left in all its hits
+  void AddPhotonTotal(double a) {
+    energy_squared += a*a; }
+  void Add(const PhotonTally &t) {
+    count += t.count;
+    energy += t.energy;
+    energy_squared += t.energy_squared;
+    for (int b = 0; b <= MAX_TALLY_BOUNCE; b++) bounces[b] += t.bounces[b]; }
+
+ private:
+  // REPRESENTATION
+  int count;
+  Vec3f energy;
+  double energy_squared;
+  int bounces[MAX_TALLY_BOUNCE+1];
+};
+
 #endif
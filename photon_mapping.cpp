@@ -12,6 +12,9 @@
 
 #include <iostream>
 #include <algorithm>
+#include <cstring>
+#include <climits>
+#include <limits>
 #include "photon_mapping.h"
 #include "mesh.h"
 #include "face.h"
@@ -21,6 +24,21 @@
 #include "raytracer.h"
 #include <stack>
 #include "sphere.h"
+#include "argparser.h"
+#include "mapped_file.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// granularity of the kdtree wireframe visualization
+#define KDTREE_PHOTONS_PER_CELL 100
+// maximum number of surfaces a photon hits before it is dropped
+#define MAX_PHOTON_BOUNCES 6
+// total power of the transmitter(s), in watts, split over all the photons
+#define TRANSMITTER_POWER 250e-3
+// z value of the 95% confidence interval of the received power
+#define CONFIDENCE_Z 1.96
 
 Vec3f global_energy;
 
@@ -33,99 +51,116 @@ PhotonMapping::~PhotonMapping() {
 
 
 // ========================================================================
-// Recursively trace a single photon
+// Trace a single photon
 
-void PhotonMapping::TracePhoton(const Vec3f &position, const Vec3f &direction, 
-                                const Vec3f &energy, int iter) const {
-    if (iter > 5) {
-        return;
+// the state of a photon along its path
+class PhotonPath {
+public:
+    PhotonPath(const Vec3f &p, const Vec3f &d, const Vec3f &e) :
+        position(p), direction(d), energy(e), bounce(0) {}
+    Vec3f position;
+    Vec3f direction;
+    Vec3f energy;
+    int bounce;
+};
+
+// The primitives one photon hit and the (average) energy it left in
+// each, added to their tallies (once per primitive) when the photon is
+// done, whichever way its path ends, so the squares in the tallies
+// are per emitted photon and not per hit.
+class PhotonReceipts {
+public:
+    PhotonReceipts(int t) : thread(t), num_prims(0) {}
+    ~PhotonReceipts() {
+        for (int i = 0; i < num_prims; i++) prims[i]->addPhotonTotal(thread, energy[i]);
     }
-    // ==============================================
-    // ASSIGNMENT: IMPLEMENT RECURSIVE PHOTON TRACING
-    // ==============================================
-    
-    
-    // Trace the photon through the scene.  At each diffuse or
-    // reflective bounce, store the photon in the kd tree.
+    void Add(Primitive *p, double e) {
+        for (int i = 0; i < num_prims; i++) {
+            if (prims[i] == p) { energy[i] += e; return; }
+        }
+        assert (num_prims < MAX_PHOTON_BOUNCES);
+        prims[num_prims] = p;
+        energy[num_prims] = e;
+        num_prims++;
+    }
+private:
+    int thread;
+    int num_prims;
+    Primitive *prims[MAX_PHOTON_BOUNCES];
+    double energy[MAX_PHOTON_BOUNCES];
+};
+
+void PhotonMapping::TracePhoton(const Vec3f &position, const Vec3f &direction, 
+                                 const Vec3f &energy,
+                                 std::vector<CompactPhoton> &photons, int thread,
+                                 Sampler &sampler) const {
+    // Follow the photon from hit to hit.  Instead of splitting it into
+    // a diffuse, a reflected and a transmitted photon at every hit,
+    // Russian roulette picks (at most) one of them, with probability
+    // proportional to the albedo of the material, and scales the
+    // energy so the expected result is the same.  A photon costs at
+    // most MAX_PHOTON_BOUNCES ray casts.
     
     // One optimization is to *not* store the first bounce, since that
     // direct light can be efficiently computed using classic ray
     // tracing.
     
-    Ray r(position, direction);
-    Hit h;
-    
-    if (raytracer->CastRay(r, h, 0)) {
-        // If we hit something...
-        Vec3f v = raytracer->TraceRay(r, h, 0);
+    PhotonPath path(position, direction, energy);
+    PhotonReceipts receipts(thread);
+    for ( ; path.bounce < MAX_PHOTON_BOUNCES; path.bounce++) {
+        Ray r(path.position, path.direction);
+        Hit h;
+        // only the hit itself is needed (material, primitive & the
+        // exit point for transmission), no shading
+        if (!raytracer->CastPhoton(r, h)) return;
         
         if (Primitive *p = h.getPrim()) {
-            Photon ph(position, direction, energy, iter);
-            p->addPhoton(ph);
+            p->addPhoton(thread, path.energy, path.bounce);
+            receipts.Add(p, path.energy.average());
         }
-                
-        Vec3f pos = r.pointAtParameter(h.getT());
         
-        // Take care of some things here...
+        Vec3f pos = r.pointAtParameter(h.getT());
         Material *m = h.getMaterial();
         assert(m != NULL);
         
         // Multiply by material consants
         Vec3f diffuse = m->getDiffuseColor();
-        //std::cout << "Diffuse: " << diffuse << "\n";
-        diffuse = diffuse * energy;
         Vec3f reflective = m->getReflectiveColor();
-        //std::cout << "Reflective: " << reflective << "\n";
-        reflective = reflective * energy;
         Vec3f transmissive = m->getTransmissiveColor();
-        transmissive = transmissive * energy;
-        
         
-        static const Vec3f zero = Vec3f(0,0,0);
-        //double photon_prob = GLOBAL_mtrand.rand();
+        double p_diffuse = diffuse.average();
+        double p_reflective = reflective.average();
+        double p_transmissive = transmissive.average();
+        double total = p_diffuse + p_reflective + p_transmissive;
+        if (total <= 0) return;
         
-        if (diffuse != zero) {
-            //std::cout << "This material diffuse\n";
-            // Diffuse
-            //Vec3f normal = h.getNormal();
-            //Vec3f V = r.getDirection();
-            Vec3f R_dir = RandomDiffuseDirection(h.getNormal());
-            //R_dir.Normalize(); RandomDiffuseDirection normalizes b4 return
-            Ray R(pos, R_dir);
-            TracePhoton(pos, R_dir, diffuse, iter+1);
-            if (iter != 0) {
-                Photon p(pos, direction, diffuse, iter);
-                kdtree->AddPhoton(p);
-            }
+        // store what arrives here (all the scattered energy)
+        if (path.bounce != 0) {
+            Vec3f scattered = (diffuse + reflective + transmissive) * path.energy;
+            Photon ph(pos, path.direction, scattered, path.bounce);
+            photons.push_back(CompactPhoton(ph));
         }
-        if (reflective != zero) {
-            //std::cout << "This material is reflective\n";
-            // Reflection
-            //Vec3f normal = h.getNormal();
-            //Vec3f V = r.getDirection();
-            Vec3f R_dir = MirrorDirection(h.getNormal(), r.getDirection());
-            R_dir.Normalize();
-            Ray R(pos, R_dir);
-            TracePhoton(pos, R_dir, reflective, iter+1);
-            if (iter != 0) {
-                Photon p(pos, direction, reflective, iter);
-                kdtree->AddPhoton(p);
-            }
-        }
-        if (transmissive != zero) {
-            Vec3f pos2 = r.pointAtParameter(h.getT2() + EPSILON);
-            
-            //Vec3f normal = h.getNormal();
-            //Vec3f V = r.getDirection();
-            //Vec3f R_dir = r.getDirection();
-            //std::cout << "R_dir.Length() is " << R_dir.Length() << "\n";
-            //R_dir.Normalize();
-            Ray R(pos2, r.getDirection());
-            TracePhoton(pos2, r.getDirection(), transmissive, iter+1);
-            if (iter != 0) {
-                Photon p(pos, direction, transmissive, iter);
-                kdtree->AddPhoton(p);
-            }
+        
+        // choose the scattering event
+        // (albedos may add up to more than 1, then the photon always survives)
+        double scale = std::max(1.0, total);
+        double xi = sampler.rand() * scale;
+        if (xi < p_diffuse) {
+            path.energy = diffuse * path.energy * (scale / p_diffuse);
+            path.position = pos;
+            path.direction = RandomDiffuseDirection(h.getNormal(), sampler);
+        } else if (xi < p_diffuse + p_reflective) {
+            path.energy = reflective * path.energy * (scale / p_reflective);
+            path.position = pos;
+            path.direction = MirrorDirection(h.getNormal(), r.getDirection());
+            path.direction.Normalize();
+        } else if (xi < total) {
+            // continue on the far side of the object
+            path.energy = transmissive * path.energy * (scale / p_transmissive);
+            path.position = r.pointAtParameter(h.getT2() + EPSILON);
+        } else {
+            // absorbed
+            return;
         }
     }
 }
@@ -136,16 +171,36 @@ void PhotonMapping::TracePhoton(const Vec3f &position, const Vec3f &direction,
 // Trace the specified number of photons through the scene
 
 void PhotonMapping::TracePhotons() {
+    if (args->load_photon_map != NULL) {
+        // the photons of an earlier run
+        if (LoadPhotonMap(args->load_photon_map)) return;
+        std::cout << "WARNING: could not use the photon map " << args->load_photon_map
+                  << ", tracing the photons instead" << std::endl;
+    }
     std::cout << "trace photons" << std::endl;
 
-    clock_t startTime = clock();
+#ifdef _OPENMP
+    double startTime = omp_get_wtime();
+#else
+    double startTime = clock() / (double)CLOCKS_PER_SEC;
+#endif
+    
+    // each thread stores its photons in a private buffer (and tallies
+    // the photons received by the primitives separately), so the
+    // parallel shoot below never contends on shared data
+#ifdef _OPENMP
+    int num_threads = omp_get_max_threads();
+#else
+    int num_threads = 1;
+#endif
+    std::vector<std::vector<CompactPhoton> > thread_photons(num_threads);
     
     // first, throw away any existing photons
     delete kdtree;
     int num_prims = mesh->numPrimitives();
     for (int i = 0; i < num_prims; ++i) {
         Primitive *p = mesh->getPrimitive(i);
-        p->resetPhotons();
+        p->resetPhotons(num_threads);
     }
     
     // consruct a kdtree to store the photons
@@ -168,6 +223,14 @@ void PhotonMapping::TracePhotons() {
     
     global_energy = Vec3f();
     
+    // all the stored photons, in emission order
+    std::vector<CompactPhoton> photons;
+    // photon number of the first photon shot from the current light
+    // (each emitted photon has its own random stream)
+    unsigned long long first_photon = 0;
+    // (for benchmarking) count the rays the photons cast
+    raytracer->ResetRayCounts();
+    
     // shoot a constant number of photons per unit area of light source
     // (alternatively, this could be based on the total energy of each light)
     for (unsigned int i = 0; i < lights.size(); i++) {  
@@ -179,21 +242,231 @@ void PhotonMapping::TracePhotons() {
      //   std::cout << "emitted energy for light " << i << ": " << num * energy << "\n";
       //  std::cout << "energy per photon: " << energy << "\n";
         global_energy += num*energy;
-#pragma omp parallel for 
+        // a static schedule hands each thread one contiguous block of
+        // photons, so concatenating the buffers in thread order below
+        // restores the emission order
+#pragma omp parallel for schedule(static)
         for (int j = 0; j < num; j++) {
-            Vec3f start = lights[i]->RandomPoint();
+#ifdef _OPENMP
+            int thread = omp_get_thread_num();
+#else
+            int thread = 0;
+#endif
+            std::vector<CompactPhoton> &buffer = thread_photons[thread];
+            Sampler sampler(args->random_seed, SAMPLER_PHOTONS, first_photon + j);
+            Vec3f start = lights[i]->RandomPoint(sampler);
             // the initial direction for this photon (for diffuse light sources)
-            Vec3f direction = RandomDiffuseDirection(normal);
-            TracePhoton(start,direction,energy,0);
+            Vec3f direction = RandomDiffuseDirection(normal, sampler);
+            TracePhoton(start,direction,energy,buffer,thread,sampler);
+        }
+        first_photon += num;
+        
+        // merge the buffers
+        for (int t = 0; t < num_threads; t++) {
+            photons.insert(photons.end(), thread_photons[t].begin(), thread_photons[t].end());
+            thread_photons[t].clear();
         }
     }
+    
+    // balance the kdtree in one pass
+    kdtree->Build(photons);
+    for (int i = 0; i < num_prims; ++i) {
+        mesh->getPrimitive(i)->mergePhotons();
+    }
 
-    std::cout << double( clock() - startTime ) / (double)CLOCKS_PER_SEC<< " seconds.\n";
+#ifdef _OPENMP
+    double seconds = omp_get_wtime() - startTime;
+#else
+    double seconds = clock() / (double)CLOCKS_PER_SEC - startTime;
+#endif
+    // the photons only find hits: no shading and no shadow rays
+    RayCounts counts = raytracer->getRayCounts();
+    std::cout << first_photon << " photons, " << counts.cast << " rays, "
+              << seconds << " seconds (" << counts.cast / std::max(seconds,1e-9) << " rays/sec), "
+              << counts.traced << " shaded, " << counts.occluded << " shadow rays.\n";
+    assert (counts.traced == 0 && counts.occluded == 0);
+    if (args->save_photon_map != NULL) SavePhotonMap(args->save_photon_map);
 
     std::cout << "end trace photons" << std::endl;
 }
 
 
+// ======================================================================
+// PHOTON MAP FILES
+// ======================================================================
+
+// bump this whenever the layout (or the meaning) of the file changes
+#define PHOTON_MAP_VERSION 4
+
+static const char photon_map_magic[8] = { 'P','H','O','T','O','N','S','\0' };
+
+// the start of a photon map file.  It is followed by the tally of each
+// primitive and then (at photons_offset) the photons, in the order of
+// the kdtree, so they can be mapped as they are.
+class PhotonMapHeader {
+public:
+  char magic[8];
+  unsigned int version;
+  unsigned int photon_size;
+  unsigned long long scene_hash;
+  int num_primitives;
+  // the shoot parameters
+  int num_photons_to_shoot;
+  int random_seed;
+  int max_bounces;
+  int intersect_backfacing;
+  // the rasterization of the primitives (part of the scene)
+  int sphere_horiz;
+  int sphere_vert;
+  int cylinder_ring_rasterization;
+  double global_energy[3];
+  double bbox_min[3];
+  double bbox_max[3];
+  unsigned long long photons_offset;
+  unsigned long long num_photons;
+};
+
+// a saved PhotonTally
+class PhotonTallyRecord {
+public:
+  int count;
+  int bounces[MAX_TALLY_BOUNCE+1];
+  double energy[3];
+  double energy_squared;
+};
+
+bool PhotonMapping::SavePhotonMap(const char *filename) const {
+  assert (kdtree != NULL);
+  int num_prims = mesh->numPrimitives();
+  PhotonMapHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, photon_map_magic, sizeof(header.magic));
+  header.version = PHOTON_MAP_VERSION;
+  header.photon_size = sizeof(CompactPhoton);
+  header.scene_hash = mesh->getSourceHash();
+  header.num_primitives = num_prims;
+  header.num_photons_to_shoot = args->num_photons_to_shoot;
+  header.random_seed = args->random_seed;
+  header.max_bounces = MAX_PHOTON_BOUNCES;
+  header.intersect_backfacing = args->intersect_backfacing;
+  header.sphere_horiz = args->sphere_horiz;
+  header.sphere_vert = args->sphere_vert;
+  header.cylinder_ring_rasterization = args->cylinder_ring_rasterization;
+  for (int k = 0; k < 3; k++) {
+    header.global_energy[k] = global_energy[k];
+    header.bbox_min[k] = kdtree->getMin()[k];
+    header.bbox_max[k] = kdtree->getMax()[k];
+  }
+  // (the photons start on an 8 byte boundary)
+  size_t tallies_size = num_prims * sizeof(PhotonTallyRecord);
+  header.photons_offset = (sizeof(header) + tallies_size + 7) / 8 * 8;
+  header.num_photons = kdtree->numPhotons();
+
+  FILE *file = fopen(filename,"wb");
+  if (file == NULL) {
+    std::cerr << "Unable to open " << filename << " for writing\n";
+    return false;
+  }
+  bool ok = fwrite(&header,sizeof(header),1,file) == 1;
+  for (int i = 0; ok && i < num_prims; i++) {
+    const PhotonTally &tally = mesh->getPrimitive(i)->getPhotonTally();
+    PhotonTallyRecord record;
+    memset(&record, 0, sizeof(record));
+    record.count = tally.numPhotons();
+    for (int b = 0; b <= MAX_TALLY_BOUNCE; b++) record.bounces[b] = tally.numPhotonsAtBounce(b);
+    for (int k = 0; k < 3; k++) record.energy[k] = tally.getEnergy()[k];
+    record.energy_squared = tally.getEnergySquared();
+    ok = fwrite(&record,sizeof(record),1,file) == 1;
+  }
+  char zeros[8] = { 0 };
+  size_t padding = header.photons_offset - sizeof(header) - tallies_size;
+  if (ok && padding > 0) ok = fwrite(zeros,padding,1,file) == 1;
+  if (ok && header.num_photons > 0) {
+    ok = fwrite(kdtree->getCompactPhotons(),sizeof(CompactPhoton),header.num_photons,file) == header.num_photons;
+  }
+  ok = (fclose(file) == 0) && ok;
+  if (!ok) {
+    std::cerr << "Error writing " << filename << "\n";
+    return false;
+  }
+  std::cout << "wrote " << header.num_photons << " photons to " << filename << "\n";
+  return true;
+}
+
+bool PhotonMapping::LoadPhotonMap(const char *filename) {
+  MappedFile file;
+  if (!file.Open(filename)) return false;
+  PhotonMapHeader header;
+  if (file.size() < sizeof(header)) {
+    std::cerr << filename << " is not a photon map\n";
+    return false;
+  }
+  memcpy(&header, file.getData(), sizeof(header));
+  int num_prims = mesh->numPrimitives();
+  if (memcmp(header.magic,photon_map_magic,sizeof(header.magic)) != 0 ||
+      header.version != PHOTON_MAP_VERSION ||
+      header.photon_size != sizeof(CompactPhoton)) {
+    std::cerr << filename << " is not a photon map (or was written by another version)\n";
+    return false;
+  }
+  if (header.scene_hash != mesh->getSourceHash() || header.num_primitives != num_prims ||
+      header.sphere_horiz != args->sphere_horiz ||
+      header.sphere_vert != args->sphere_vert ||
+      header.cylinder_ring_rasterization != args->cylinder_ring_rasterization) {
+    std::cerr << "the photons in " << filename << " were traced in a different scene\n";
+    return false;
+  }
+  // (the photons would go elsewhere)
+  if (header.max_bounces != MAX_PHOTON_BOUNCES ||
+      header.intersect_backfacing != (int)args->intersect_backfacing) {
+    std::cerr << "the photons in " << filename << " were traced with "
+              << header.max_bounces << " bounces" << (header.intersect_backfacing ? ", intersecting back faces" : "")
+              << ", not with the current settings\n";
+    return false;
+  }
+  // (another seed gives other photons, but just as good a photon map)
+  if (header.random_seed != args->random_seed) {
+    std::cout << "the photons in " << filename << " were traced with -random_seed " << header.random_seed << "\n";
+  }
+  // (divide, so a bad count can't wrap around to the right size)
+  if (header.photons_offset < sizeof(header) + num_prims*sizeof(PhotonTallyRecord) ||
+      header.photons_offset > file.size() ||
+      (file.size() - header.photons_offset) % sizeof(CompactPhoton) != 0 ||
+      (file.size() - header.photons_offset) / sizeof(CompactPhoton) != header.num_photons ||
+      header.num_photons > INT_MAX) {
+    std::cerr << filename << " is truncated (or corrupt)\n";
+    return false;
+  }
+
+  // the photons themselves stay in the file
+  delete kdtree;
+  kdtree = new KDTree(BoundingBox(Vec3f(header.bbox_min[0],header.bbox_min[1],header.bbox_min[2]),
+                                  Vec3f(header.bbox_max[0],header.bbox_max[1],header.bbox_max[2])));
+  if (!kdtree->Map(filename,header.photons_offset,(int)header.num_photons)) {
+    std::cerr << "the photons in " << filename << " are corrupt\n";
+    delete kdtree;
+    kdtree = NULL;
+    return false;
+  }
+  const char *p = file.getData() + sizeof(header);
+  for (int i = 0; i < num_prims; i++) {
+    PhotonTallyRecord record;
+    memcpy(&record, p + i*sizeof(record), sizeof(record));
+    Vec3f energy(record.energy[0],record.energy[1],record.energy[2]);
+    mesh->getPrimitive(i)->setPhotonTally(PhotonTally(record.count,energy,record.energy_squared,record.bounces));
+  }
+  global_energy = Vec3f(header.global_energy[0],header.global_energy[1],header.global_energy[2]);
+
+  // the energy per photon depends on how many were shot
+  if (header.num_photons_to_shoot != args->num_photons_to_shoot) {
+    std::cout << "using -num_photons_to_shoot " << header.num_photons_to_shoot << " of the photon map\n";
+    args->num_photons_to_shoot = header.num_photons_to_shoot;
+  }
+  std::cout << "read " << header.num_photons << " photons from " << filename << "\n";
+  return true;
+}
+
+
 // ======================================================================
 // PHOTON VISUALIZATION FOR DEBUGGING
 // ======================================================================
@@ -209,27 +482,15 @@ void PhotonMapping::RenderPhotonPositions() {
     glDisable(GL_LIGHTING);
     glPointSize(3);
     glBegin(GL_POINTS);
-    // walk through all the cells of the kdtree
-    std::vector<const KDTree*> todo;  
-    todo.push_back(kdtree);
-    while (!todo.empty()) {
-        const KDTree *node = todo.back();
-        todo.pop_back(); 
-        if (node->isLeaf()) {
-            const std::vector<Photon> &photons = node->getPhotons();
-            int num_photons = photons.size();
-            for (int i = 0; i < num_photons; i++) {
-                const Photon &p = photons[i];
-                Vec3f energy = p.getEnergy()*args->num_photons_to_shoot;
-                glColor3f(energy.x(),energy.y(),energy.z());
-                const Vec3f &position = p.getPosition();
-                // draw each photon as a gl point
-                glVertex3f(position.x(),position.y(),position.z());
-            }
-        } else {
-            todo.push_back(node->getChild1());
-            todo.push_back(node->getChild2());
-        } 
+    // walk through all the photons of the kdtree
+    int num_photons = kdtree->numPhotons();
+    for (int i = 0; i < num_photons; i++) {
+        const CompactPhoton &p = kdtree->getCompactPhoton(i);
+        Vec3f energy = p.getEnergy()*args->num_photons_to_shoot;
+        glColor3f(energy.x(),energy.y(),energy.z());
+        const Vec3f position = p.getPosition();
+        // draw each photon as a gl point
+        glVertex3f(position.x(),position.y(),position.z());
     }
     glEnd();
     glEnable(GL_LIGHTING);
@@ -242,31 +503,19 @@ void PhotonMapping::RenderPhotonDirections() {
     glDisable(GL_LIGHTING);
     glLineWidth(1);
     glBegin(GL_LINES);
-    // walk through all the cells of the kdtree
-    std::vector<const KDTree*> todo;  
-    todo.push_back(kdtree);
+    // walk through all the photons of the kdtree
     BoundingBox *bb = mesh->getBoundingBox();
     double max_dim = bb->maxDim();
-    while (!todo.empty()) {
-        const KDTree *node = todo.back();
-        todo.pop_back(); 
-        if (node->isLeaf()) {
-            const std::vector<Photon> &photons = node->getPhotons();
-            int num_photons = photons.size();
-            for (int i = 0; i < num_photons; i++) {
-                const Photon &p = photons[i];
-                const Vec3f a = p.getPosition();
-                Vec3f b = p.getPosition()-(p.getDirectionFrom()*0.02*max_dim);
-                Vec3f energy = p.getEnergy()*args->num_photons_to_shoot;
-                glColor3f(energy.x(),energy.y(),energy.z());
-                // draw each photon direction as a small line segment
-                glVertex3f(a.x(),a.y(),a.z());
-                glVertex3f(b.x(),b.y(),b.z());
-            }
-        } else {
-            todo.push_back(node->getChild1());
-            todo.push_back(node->getChild2());
-        } 
+    int num_photons = kdtree->numPhotons();
+    for (int i = 0; i < num_photons; i++) {
+        const Photon p = kdtree->getPhoton(i);
+        const Vec3f a = p.getPosition();
+        Vec3f b = p.getPosition()-(p.getDirectionFrom()*0.02*max_dim);
+        Vec3f energy = p.getEnergy()*args->num_photons_to_shoot;
+        glColor3f(energy.x(),energy.y(),energy.z());
+        // draw each photon direction as a small line segment
+        glVertex3f(a.x(),a.y(),a.z());
+        glVertex3f(b.x(),b.y(),b.z());
     }
     glEnd();
     glEnable(GL_LIGHTING);
@@ -281,62 +530,50 @@ void PhotonMapping::RenderKDTree() {
     glLineWidth(1);
     glColor3f(0,0,0);
     glBegin(GL_LINES);
-    std::vector<const KDTree*> todo;  
-    todo.push_back(kdtree);
-    while (!todo.empty()) {
-        const KDTree *node = todo.back();
-        todo.pop_back(); 
-        if (node->isLeaf()) {
-            const Vec3f& min = node->getMin();
-            const Vec3f& max = node->getMax();
-            
-            glVertex3f(min.x(),min.y(),min.z());
-            glVertex3f(max.x(),min.y(),min.z());
-            glVertex3f(min.x(),min.y(),min.z());
-            glVertex3f(min.x(),max.y(),min.z());
-            glVertex3f(max.x(),max.y(),min.z());
-            glVertex3f(max.x(),min.y(),min.z());
-            glVertex3f(max.x(),max.y(),min.z());
-            glVertex3f(min.x(),max.y(),min.z());
-            
-            glVertex3f(min.x(),min.y(),min.z());
-            glVertex3f(min.x(),min.y(),max.z());
-            glVertex3f(min.x(),max.y(),min.z());
-            glVertex3f(min.x(),max.y(),max.z());
-            glVertex3f(max.x(),min.y(),min.z());
-            glVertex3f(max.x(),min.y(),max.z());
-            glVertex3f(max.x(),max.y(),min.z());
-            glVertex3f(max.x(),max.y(),max.z());
-            
-            glVertex3f(min.x(),min.y(),max.z());
-            glVertex3f(max.x(),min.y(),max.z());
-            glVertex3f(min.x(),min.y(),max.z());
-            glVertex3f(min.x(),max.y(),max.z());
-            glVertex3f(max.x(),max.y(),max.z());
-            glVertex3f(max.x(),min.y(),max.z());
-            glVertex3f(max.x(),max.y(),max.z());
-            glVertex3f(min.x(),max.y(),max.z());
-            
-        } else {
-            todo.push_back(node->getChild1());
-            todo.push_back(node->getChild2());
-        } 
+    // draw the cells down to roughly KDTREE_PHOTONS_PER_CELL photons each
+    int max_depth = 0;
+    while ((kdtree->numPhotons() >> max_depth) > KDTREE_PHOTONS_PER_CELL) max_depth++;
+    std::vector<BoundingBox> cells;
+    kdtree->CollectCells(max_depth, cells);
+    for (unsigned int i = 0; i < cells.size(); i++) {
+        const Vec3f& min = cells[i].getMin();
+        const Vec3f& max = cells[i].getMax();
+        
+        glVertex3f(min.x(),min.y(),min.z());
+        glVertex3f(max.x(),min.y(),min.z());
+        glVertex3f(min.x(),min.y(),min.z());
+        glVertex3f(min.x(),max.y(),min.z());
+        glVertex3f(max.x(),max.y(),min.z());
+        glVertex3f(max.x(),min.y(),min.z());
+        glVertex3f(max.x(),max.y(),min.z());
+        glVertex3f(min.x(),max.y(),min.z());
+        
+        glVertex3f(min.x(),min.y(),min.z());
+        glVertex3f(min.x(),min.y(),max.z());
+        glVertex3f(min.x(),max.y(),min.z());
+        glVertex3f(min.x(),max.y(),max.z());
+        glVertex3f(max.x(),min.y(),min.z());
+        glVertex3f(max.x(),min.y(),max.z());
+        glVertex3f(max.x(),max.y(),min.z());
+        glVertex3f(max.x(),max.y(),max.z());
+        
+        glVertex3f(min.x(),min.y(),max.z());
+        glVertex3f(max.x(),min.y(),max.z());
+        glVertex3f(min.x(),min.y(),max.z());
+        glVertex3f(min.x(),max.y(),max.z());
+        glVertex3f(max.x(),max.y(),max.z());
+        glVertex3f(max.x(),min.y(),max.z());
+        glVertex3f(max.x(),max.y(),max.z());
+        glVertex3f(min.x(),max.y(),max.z());
     }
     glEnd();
     glEnable(GL_LIGHTING);
 }
 
 Vec3f PhotonMapping::CalculateEnergy(Sphere *s) {
-			const double power = 250e-3; 
+			const double power = TRANSMITTER_POWER;
 
-			std::vector<Photon> photons = s->getPhotons();
-			std::vector<Photon>::iterator it;
-			Vec3f total_energy;
-			
-			for(it = photons.begin(); it < photons.end(); it++) {
-				Vec3f e = it->getEnergy();
-				total_energy += e;
-			}
+			Vec3f total_energy = s->getPhotonTally().getEnergy();
 			double power_per_photon = power / args->num_photons_to_shoot;
 			total_energy *= power_per_photon;
 			return total_energy;
@@ -346,7 +583,7 @@ void PhotonMapping::RenderEnergy()
 {
     for (int i = 0; i < mesh->numPrimitives(); ++i) {
         Primitive *p = mesh->getPrimitive(i);
-        int q = p->getPhotons().size();
+        int q = p->getPhotonTally().numPhotons();
         std::cout << "Primitive " << i << " has " << q << " photons\n";
         if (Sphere *s = dynamic_cast<Sphere*> (p)) {
 			double r = s->getRadius();
@@ -376,23 +613,47 @@ void PhotonMapping::RenderEnergy()
     }
 }
 
-bool sort(const std::pair<int, double> &l, const std::pair<int, double> &r)
-{
-    if (l.second < r.second) {
-        return true;
-    }
-    return false;
-}
+// ======================================================================
+// The machine readable version of RenderEnergy: one line per receiver
+// sphere with the photons it received and the received power (in watts
+// and dBm).  Each photon shot is one sample of the received power
+// (zero for the ones that never got there), so the sum of the squared
+// per photon totals gives the variance of the estimate and a 95%
+// confidence interval.  There is no dBm for no power: those fields
+// (e.g., all three for a receiver no photon reached, or the low one
+// when the interval includes 0) are left empty.
 
-unsigned long count_photons(const KDTree *kd)
-{
-    if (kd->isLeaf()) {
-        return kd->getPhotons().size();
+bool PhotonMapping::WriteCoverageReport(const char *filename) {
+    FILE *file = fopen(filename,"w");
+    if (file == NULL) {
+        std::cerr << "Unable to open " << filename << " for writing\n";
+        return false;
     }
-    
-    unsigned long num = kd->getPhotons().size();
-    
-    return num + count_photons(kd->getChild1()) + count_photons(kd->getChild2());
+    fprintf (file, "receiver,x,y,z,radius,photons,power_w,power_low_w,power_high_w,dbm,dbm_low,dbm_high\n");
+    double n = args->num_photons_to_shoot;
+    double power_per_photon = TRANSMITTER_POWER / n;
+    for (int i = 0; i < mesh->numPrimitives(); ++i) {
+        Sphere *s = dynamic_cast<Sphere*> (mesh->getPrimitive(i));
+        if (s == NULL) continue;
+        const PhotonTally &tally = s->getPhotonTally();
+        double sum = tally.getEnergy().average() * power_per_photon;
+        double sum_squared = tally.getEnergySquared() * power_per_photon * power_per_photon;
+        double error = CONFIDENCE_Z * sqrt(std::max(0.0, sum_squared - sum*sum/n));
+        double low = std::max(0.0, sum-error);
+        double high = sum+error;
+        Vec3f c = s->getCenter();
+        fprintf (file, "%d,%g,%g,%g,%g,%d,%g,%g,%g",
+                 i, c.x(), c.y(), c.z(), s->getRadius(), tally.numPhotons(),
+                 sum, low, high);
+        double watts[3] = { sum, low, high };
+        for (int k = 0; k < 3; k++) {
+            if (watts[k] > 0) fprintf (file, ",%g", 10*log10(watts[k]/1e-3));
+            else fprintf (file, ",");
+        }
+        fprintf (file, "\n");
+    }
+    fclose(file);
+    return true;
 }
 
 // ======================================================================
@@ -409,79 +670,25 @@ Vec3f PhotonMapping::GatherIndirect(const Vec3f &point, const Vec3f &normal, con
     // ASSIGNMENT: GATHER THE INDIRECT ILLUMINATION FROM THE PHOTON MAP
     // ================================================================
     
-    const unsigned int collect = args->num_photons_to_collect;
-    
-    // Temporary photon holder
-    std::vector<Photon> photons;
-    
-    const Vec3f exp = Vec3f(0.5, 0.5, 0.5);
-    
-    Vec3f min = point - exp;
-    Vec3f max = point + exp;
-    
-    std::vector<std::pair<int, double> > pairs;
-        
-    BoundingBox b(min, max);
-        
-    while (1) {
-        kdtree->CollectPhotonsInBox(b, photons);
-        
-        while (photons.size() < collect) {
-            photons.clear();
-            min -= exp;
-            max += exp;
-            b.Set(min, max);
-            kdtree->CollectPhotonsInBox(b, photons);
-        }
-        
-        //std::cout << "We have " << photons.size() << " neighbors\n";
-        
-        for (unsigned int i = 0; i < photons.size(); ++i) {
-            double d = DistanceBetweenTwoPoints2(point, photons[i].getPosition());
-            // TODO: Should maxDim below be divided by 2.0 or not???
-            if (d > b.maxDim() * b.maxDim() /* / 2.0 */ ) {
-                //std::cout << "throwing this one out, too far!\n";
-                //std::cout << "d is " << d << " and maxDim is " << b.maxDim() << "\n";
-                continue;
-            }
-            pairs.push_back(std::make_pair(i, d));
-        }
-        
-        if (pairs.size() >= collect) {
-            break;
-        }
-        
-        photons.clear();
-        min -= exp;
-        max += exp;
-        b.Set(min, max);
-    }
-    
-    // Just a sanity check.
-    assert(pairs.size() >= collect);
-    
-    std::sort(pairs.begin(), pairs.end(), sort);
-    
-    while (pairs.size() > collect) {
-        pairs.pop_back();
+    // collect the closest args->num_photons_to_collect photons (at any
+    // distance, so there are fewer only if fewer were stored)
+    std::vector<std::pair<double,int> > nearest;
+    kdtree->FindKNearest(point, args->num_photons_to_collect, std::numeric_limits<double>::infinity(), nearest);
+    if (nearest.empty()) {
+        return Vec3f(0,0,0);
     }
     
-    double maxDist = pairs.back().second;
+    // determine the radius that was necessary to collect that many photons
+    double maxDist = nearest.back().first;
     
+    // average the energy of those photons over that radius
     Vec3f ne;
-    
-    for (unsigned int i = 0; i < pairs.size(); ++i) {
-        Vec3f te = photons[pairs[i].first].getEnergy();
+    for (unsigned int i = 0; i < nearest.size(); ++i) {
+        Vec3f te = kdtree->getCompactPhoton(nearest[i].second).getEnergy();
         // TODO: Is the following multiplication good or bad???
         te /= maxDist;// * maxDist;
         ne += te;
     }
     
     return ne;
-    
-    // collect the closest args->num_photons_to_collect photons
-    // determine the radius that was necessary to collect that many photons
-    // average the energy of those photons over that radius
-    return Vec3f(0,0,0);
 }
-
@@ -4,6 +4,7 @@
 #include <vector>
 #include "vectors.h"
 #include "photon.h"
+#include "sampler.h"
 
 class Mesh;
 class ArgParser;
@@ -35,11 +36,20 @@ class PhotonMapping {
   void setRayTracer(RayTracer *r) { raytracer = r; }
   void setRadiosity(Radiosity *r) { radiosity = r; }
 
-  // step 1: send the photons throughout the scene
+  // step 1: send the photons throughout the scene (or read them from
+  // -load_photon_map, and write them to -save_photon_map)
   void TracePhotons();
+  // the photons (the kdtree), the photon tallies of the primitives &
+  // the shoot parameters.  Loading maps the photons from the file and
+  // fails (and says why) unless it was saved for the same scene (and
+  // primitive rasterization), seed, bounces & back face intersection.
+  bool SavePhotonMap(const char *filename) const;
+  bool LoadPhotonMap(const char *filename);
   // step 2: collect the photons and return the contribution from indirect illumination
   Vec3f GatherIndirect(const Vec3f &point, const Vec3f &normal, const Vec3f &direction_from) const;
   Vec3f CalculateEnergy(Sphere* s);
+  // per receiver sphere: photons, power & dBm, written as CSV
+  bool WriteCoverageReport(const char *filename);
   // for visualization
   void RenderPhotons();
   void RenderKDTree();
@@ -47,8 +57,12 @@ class PhotonMapping {
 
  private:
 
-  // trace a single photon
-  void TracePhoton(const Vec3f &position, const Vec3f &direction, const Vec3f &energy, int iter) const;
+  // trace a single photon, appending the stored photons to the
+  // calling thread's buffer (merged into the kdtree afterwards),
+  // tallying the hit primitives in that thread's slot and drawing
+  // random numbers from the photon's own stream
+  void TracePhoton(const Vec3f &position, const Vec3f &direction, const Vec3f &energy,
+                   std::vector<CompactPhoton> &photons, int thread, Sampler &sampler) const;
 
   // helper functions for visualization
   void RenderPhotonPositions();
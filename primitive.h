@@ -2,7 +2,10 @@
 #define _PRIMITIVE_H_
 
 #include <vector>
+#include <cassert>
 #include "photon.h"
+#include "utils.h"
+#include "boundingbox.h"
 
 class Mesh;
 class Ray;
@@ -10,6 +13,15 @@ class Hit;
 class Material;
 class ArgParser;
 
+// ====================================================================
+// One thread's photon tally, on cache lines of its own: the threads
+// update their tallies for every hit, and tallies sharing a line
+// would make the cores fight over it (false sharing).  (The vector
+// of them needs a CacheLineAllocator to honor the alignment.)
+
+class alignas(CACHE_LINE_SIZE) ThreadPhotonTally : public PhotonTally {
+};
+
 // ====================================================================
 // The base class for implicit object representations.  These objects
 // can be intersected with a ray for ray tracing and also be
@@ -24,21 +36,41 @@ public:
     
     // for ray tracing
     virtual bool intersect(const Ray &r, Hit &h) const = 0;
+    virtual BoundingBox getBoundingBox() const = 0;
     
     // for OpenGL rendering & radiosity
     virtual void addRasterizedFaces(Mesh *m, ArgParser *args) = 0;
     
-    // For photon mapping radio transmission project
-    void addPhoton(const Photon &p) {
-        photons.push_back(p);
+    // For photon mapping radio transmission project.  While the
+    // photons are traced each thread adds to its own tally (no
+    // locking), the tallies are merged once tracing is done.
+    void resetPhotons(int num_threads) {
+        thread_tallies.assign(num_threads, ThreadPhotonTally());
+        tally.Clear();
     }
     
-    std::vector<Photon> getPhotons() {
-        return photons;
+    void addPhoton(int thread, const Vec3f &energy, int bounce) {
+        assert (thread >= 0 && thread < (int)thread_tallies.size());
+        thread_tallies[thread].Add(energy, bounce);
+    }
+    
+    void addPhotonTotal(int thread, double energy) {
+        assert (thread >= 0 && thread < (int)thread_tallies.size());
+        thread_tallies[thread].AddPhotonTotal(energy);
+    }
+    
+    void mergePhotons() {
+        tally.Clear();
+        for (unsigned int t = 0; t < thread_tallies.size(); t++) {
+            tally.Add(thread_tallies[t]);
+        }
     }
     
-    void resetPhotons() {
-        photons.clear();
+    const PhotonTally& getPhotonTally() const { return tally; }
+    // (from a saved photon map)
+    void setPhotonTally(const PhotonTally &t) {
+        thread_tallies.clear();
+        tally = t;
     }
     
     double getIntensity() { return intensity; }
@@ -56,7 +88,8 @@ public:
 protected:
     // REPRESENTATION
     Material *material;
-    std::vector<Photon> photons;
+    std::vector<ThreadPhotonTally,CacheLineAllocator<ThreadPhotonTally> > thread_tallies;
+    PhotonTally tally;
     double intensity;
 };
 
@@ -1,5 +1,6 @@
 #include <cstdio>
 #include <cstdlib>
+#include <ctime>
 
 // Included files for OpenGL Rendering
 #ifdef __APPLE__
@@ -16,6 +17,11 @@
 #include "raytree.h"
 #include "raytracer.h"
 #include "utils.h"
+#include "sampler.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 // ================================================================
 // CONSTRUCTOR & DESTRUCTOR
@@ -24,11 +30,7 @@ Radiosity::Radiosity(Mesh *m, ArgParser *a) {
     mesh = m;
     args = a;
     num_faces = -1;  
-    formfactors = NULL;
     area = NULL;
-    undistributed = NULL;
-    absorbed = NULL;
-    radiance = NULL;
     max_undistributed_patch = -1;
     total_area = -1;
     Reset();
@@ -39,37 +41,43 @@ Radiosity::~Radiosity() {
 }
 
 void Radiosity::Cleanup() {
-    delete [] formfactors;
+    // (swap with empty vectors to really free the memory)
+    std::vector<int>().swap(ff_start);
+    std::vector<int>().swap(ff_patch);
+    std::vector<float>().swap(ff_value);
     delete [] area;
-    delete [] undistributed;
-    delete [] absorbed;
-    delete [] radiance;
+    for (int c = 0; c < 3; c++) {
+        std::vector<float>().swap(undistributed[c]);
+        std::vector<float>().swap(absorbed[c]);
+        std::vector<float>().swap(radiance[c]);
+        std::vector<float>().swap(reflectance[c]);
+    }
     num_faces = -1;
-    formfactors = NULL;
     area = NULL;
-    undistributed = NULL;
-    absorbed = NULL;
-    radiance = NULL;
     max_undistributed_patch = -1;
     total_area = -1;
 }
 
 void Radiosity::Reset() {
     delete [] area;
-    delete [] undistributed;
-    delete [] absorbed;
-    delete [] radiance;
     
     // create and fill the data structures
     num_faces = mesh->numFaces();
     area = new double[num_faces];
-    undistributed = new Vec3f[num_faces];
-    absorbed = new Vec3f[num_faces];
-    radiance = new Vec3f[num_faces];
+    for (int c = 0; c < 3; c++) {
+        undistributed[c].resize(num_faces);
+        absorbed[c].resize(num_faces);
+        radiance[c].resize(num_faces);
+        reflectance[c].resize(num_faces);
+    }
     for (int i = 0; i < num_faces; i++) {
         Face *f = mesh->getFace(i);
         f->setRadiosityPatchIndex(i);
         setArea(i,f->getArea());
+        Vec3f diffuse = f->getMaterial()->getDiffuseColor();
+        for (int c = 0; c < 3; c++) {
+            reflectance[c][i] = diffuse[c];
+        }
         Vec3f emit = f->getMaterial()->getEmittedColor();
         setUndistributed(i,emit);
         setAbsorbed(i,Vec3f(0,0,0));
@@ -86,79 +94,259 @@ void Radiosity::Reset() {
 void Radiosity::findMaxUndistributed() {
     // find the patch with the most undistributed energy 
     // don't forget that the patches may have different sizes!
-    max_undistributed_patch = -1;
+    // (after this, Iterate keeps the heap up to date as it goes)
+    std::vector<double> energy(num_faces);
     total_undistributed = 0;
     total_area = 0;
-    double max = -1;
     for (int i = 0; i < num_faces; i++) {
-        double m = getUndistributed(i).Length() * getArea(i);
-        total_undistributed += m;
+        energy[i] = getUndistributed(i).Length() * getArea(i);
+        total_undistributed += energy[i];
         total_area += getArea(i);
-        if (max < m) {
-            max = m;
-            max_undistributed_patch = i;
-        }
     }
+    undistributed_heap.Initialize(energy);
+    max_undistributed_patch = undistributed_heap.top();
     assert (max_undistributed_patch >= 0 && max_undistributed_patch < num_faces);
 }
 
+void Radiosity::updateUndistributed(int i) {
+    double energy = getUndistributed(i).Length() * getArea(i);
+    total_undistributed += energy - undistributed_heap.getKey(i);
+    undistributed_heap.Update(i,energy);
+}
+
+
+// =======================================================================================
+// FORM FACTORS
+// =======================================================================================
+
+void Radiosity::SamplePatches(std::vector<Vec3f> &points) const {
+    int n = args->num_form_factor_samples;
+    assert (n >= 1);
+    points.resize(num_faces*n);
+    std::vector<int> rows(n);
+    for (int i = 0; i < num_faces; ++i) {
+        Face *f = mesh->getFace(i);
+        if (n == 1) {
+            // a single sample: the centroid
+            points[i] = f->computeCentroid();
+            continue;
+        }
+        // "n-rooks": sample k is in column k and in row rows[k] of an
+        // n x n grid over the patch (a random permutation), so every
+        // row & every column of the grid has exactly one sample
+        Sampler sampler(args->random_seed, SAMPLER_FORM_FACTORS, i);
+        for (int k = 0; k < n; ++k) {
+            rows[k] = k;
+        }
+        for (int k = n-1; k > 0; --k) {
+            std::swap(rows[k], rows[sampler.randInt() % (k+1)]);
+        }
+        for (int k = 0; k < n; ++k) {
+            double s = (k + sampler.rand()) / n;
+            double t = (rows[k] + sampler.rand()) / n;
+            points[i*n+k] = f->PointAt(s,t);
+        }
+    }
+}
+
+
+double Radiosity::PatchFormFactor(int i, int j, const std::vector<Vec3f> &points,
+                                  const std::vector<Vec3f> &normals, long long &num_rays) const {
+    if (i == j) return 0;
+    
+    // the k-th sample of i sees the k-th sample of j as a small disk
+    // of 1/n of the area of j.  (The disk keeps the estimate finite
+    // for samples very close to each other, e.g. near a shared edge.)
+    int n = args->num_form_factor_samples;
+    double disk_area = getArea(j) / n;
+    double formfactor = 0.0;
+    for (int k = 0; k < n; ++k) {
+        const Vec3f &p1 = points[i*n+k];
+        const Vec3f &p2 = points[j*n+k];
+        // Get the vec for p1-->p2
+        Vec3f line_p1p2 = p2 - p1;
+        double R2 = line_p1p2.Dot3(line_p1p2);
+        if (R2 == 0) continue;
+        line_p1p2.Normalize();
+        double cos_p1 = normals[i].Dot3(line_p1p2);
+        double cos_p2 = normals[j].Dot3(-line_p1p2);
+        if (cos_p1 <= EPSILON || cos_p2 <= EPSILON) continue;
+        
+        // is anything in between?
+        num_rays++;
+        if (raytracer->Occluded(p1,p2,true)) continue;
+        formfactor += cos_p1 * cos_p2 * disk_area / (M_PI * R2 + disk_area);
+    }
+    return formfactor;
+}
+
 
 void Radiosity::ComputeFormFactors() {
-    assert (formfactors == NULL);
+    assert (!hasFormFactors());
     assert (num_faces > 0);
-    formfactors = new double[num_faces*num_faces];
+    assert (raytracer != NULL);
+
+#ifdef _OPENMP
+    double startTime = omp_get_wtime();
+#else
+    double startTime = clock() / (double)CLOCKS_PER_SEC;
+#endif
 
     // =====================================
     // ASSIGNMENT:  COMPUTE THE FORM FACTORS
     // =====================================
+
+    std::vector<Vec3f> points;
+    SamplePatches(points);
+    std::vector<Vec3f> normals(num_faces);
     for (int i = 0; i < num_faces; ++i) {
-        for (int j = i; j < num_faces; ++j) {
-            if (i == j) {
-                formfactors[i * num_faces + j] = 0;
-                continue;
-            }
-            
-            Face *f1 = mesh->getFace(i);
-            Face *f2 = mesh->getFace(j);
-            
-            double formfactor = 0.0;
-            
-            Vec3f p1 = f1->computeCentroid();
-            Vec3f p2 = f2->computeCentroid();
-            // Get the vec for p1-->p2
-            Vec3f line_p1p2 = p2 - p1;
-            double R2 = line_p1p2.Length() * line_p1p2.Length();
-            Vec3f p1Normal = f1->computeNormal();
-            line_p1p2.Normalize();
-            double cos_p1 = p1Normal.Dot3(line_p1p2);
-                        
-            Vec3f p2Normal = f2->computeNormal();
-            double cos_p2 = p2Normal.Dot3(-line_p1p2);
-            
-            double ff = 0.0;
+        normals[i] = mesh->getFace(i)->computeNormal();
+    }
 
-            if (cos_p1 > EPSILON && cos_p2 > EPSILON) {
-                ff = cos_p1 * cos_p2 / (M_PI * R2);
+    // the rows are independent, so they are spread over the threads.
+    // Each row is computed dense (in a scratch row per thread) and its
+    // smallest entries are dropped, as long as together they carry at
+    // most form_factor_threshold of the row's energy.  The kept entries
+    // are scaled back up to sum to 1, so no energy is lost; at most
+    // that fraction of it goes to nearby patches instead of the ones
+    // that would get very little.
+    std::vector<std::vector<int> > row_patch(num_faces);
+    std::vector<std::vector<float> > row_value(num_faces);
+    long long num_rays = 0;
+#pragma omp parallel reduction(+:num_rays)
+    {
+        std::vector<double> row(num_faces);
+        std::vector<std::pair<double,int> > smallest;
+        // (the cost of a row depends on how many patches it faces)
+#pragma omp for schedule(dynamic,16)
+        for (int i = 0; i < num_faces; ++i) {
+            double sum = 0;
+            for (int j = 0; j < num_faces; ++j) {
+                row[j] = PatchFormFactor(i,j,points,normals,num_rays);
+                sum += row[j];
             }
-            
-            formfactor += ff;
-            
-            formfactors[i * num_faces + j] = formfactor * getArea(i)/getArea(j);
-            formfactors[j * num_faces + i] = formfactor * getArea(j)/getArea(i);
+            if (sum == 0) continue;
+            // drop the smallest entries (from the scratch row) within the budget
+            double kept = sum;
+            if (args->form_factor_threshold > 0) {
+                smallest.clear();
+                for (int j = 0; j < num_faces; ++j) {
+                    if (row[j] > 0) smallest.push_back(std::make_pair(row[j],j));
+                }
+                std::sort(smallest.begin(),smallest.end());
+                double budget = args->form_factor_threshold * sum;
+                double dropped = 0;
+                for (unsigned int k = 0; k < smallest.size(); ++k) {
+                    if (dropped + smallest[k].first > budget) break;
+                    dropped += smallest[k].first;
+                    row[smallest[k].second] = 0;
+                }
+                kept = sum - dropped;
+            }
+            for (int j = 0; j < num_faces; ++j) {
+                if (row[j] > 0) {
+                    row_patch[i].push_back(j);
+                    row_value[i].push_back(row[j] / kept);
+                }
+            }
+        }
+    }
+
+    // transpose the rows into the columns
+    ff_start.assign(num_faces+1,0);
+    for (int i = 0; i < num_faces; ++i) {
+        for (unsigned int k = 0; k < row_patch[i].size(); ++k) {
+            ff_start[row_patch[i][k]+1]++;
         }
-     
-        normalizeFormFactors(i);
     }
+    for (int j = 0; j < num_faces; ++j) {
+        ff_start[j+1] += ff_start[j];
+    }
+    ff_patch.resize(ff_start[num_faces]);
+    ff_value.resize(ff_start[num_faces]);
+    std::vector<int> next(ff_start.begin(),ff_start.end()-1);
+    for (int i = 0; i < num_faces; ++i) {
+        for (unsigned int k = 0; k < row_patch[i].size(); ++k) {
+            int j = row_patch[i][k];
+            ff_patch[next[j]] = i;
+            ff_value[next[j]] = row_value[i][k];
+            next[j]++;
+        }
+        // free each row as soon as it is copied
+        std::vector<int>().swap(row_patch[i]);
+        std::vector<float>().swap(row_value[i]);
+    }
+
+#ifdef _OPENMP
+    double seconds = omp_get_wtime() - startTime;
+#else
+    double seconds = clock() / (double)CLOCKS_PER_SEC - startTime;
+#endif
+    printf ("kept %d of %.0f form factors (%.2f%%), %lld visibility rays in %.2f seconds\n",
+            numFormFactors(), double(num_faces)*num_faces,
+            100.0*numFormFactors()/(double(num_faces)*num_faces), num_rays, seconds);
 }
 
 
 // ================================================================
 // ================================================================
 
+void Radiosity::Shoot(int j, const float light[3], int first, int last) {
+    // the part of the column that goes to first..last-1
+    int begin = std::lower_bound(ff_patch.begin()+ff_start[j],
+                                 ff_patch.begin()+ff_start[j+1], first) - ff_patch.begin();
+    int end = std::lower_bound(ff_patch.begin()+begin,
+                               ff_patch.begin()+ff_start[j+1], last) - ff_patch.begin();
+    if (begin == end) return;
+    const int *patch = &ff_patch[0];
+    const float *value = &ff_value[0];
+    for (int c = 0; c < 3; c++) {
+        float *rad = &radiance[c][0];
+        float *undist = &undistributed[c][0];
+        float *absorb = &absorbed[c][0];
+        const float *p = &reflectance[c][0];
+        float e = light[c];
+        // (a column has each receiver at most once, so the lanes never
+        // write the same patch)
+#pragma omp simd
+        for (int k = begin; k < end; k++) {
+            int i = patch[k];
+            float in = value[k] * e;
+            float reflected = p[i] * in;
+            rad[i] += reflected;
+            undist[i] += reflected;
+            absorb[i] += in - reflected;
+        }
+    }
+}
+
+void Radiosity::ShootAll(const std::vector<int> &shooters, const std::vector<float> light[3]) {
+    // each thread updates its own (contiguous) range of receivers.  The
+    // receivers of a column are sorted, so Shoot finds the thread's
+    // part of the column with a binary search.
+#pragma omp parallel if (shooters.size() > 1)
+    {
+#ifdef _OPENMP
+        int num_threads = omp_get_num_threads();
+        int thread = omp_get_thread_num();
+#else
+        int num_threads = 1;
+        int thread = 0;
+#endif
+        int first = (long long)num_faces * thread / num_threads;
+        int last = (long long)num_faces * (thread+1) / num_threads;
+        for (unsigned int s = 0; s < shooters.size(); ++s) {
+            float l[3] = { light[0][s], light[1][s], light[2][s] };
+            Shoot(shooters[s],l,first,last);
+        }
+    }
+}
+
+
 double Radiosity::Iterate() {
-    if (formfactors == NULL) 
+    if (!hasFormFactors()) 
         ComputeFormFactors();
-    assert (formfactors != NULL);
+    assert (hasFormFactors());
     
     
     
@@ -166,29 +354,74 @@ double Radiosity::Iterate() {
     // ASSIGNMENT:  IMPLEMENT RADIOSITY ALGORITHM
     // ==========================================
     
-    for (int i = 0; i < num_faces; ++i) {
-        Face *f1 = mesh->getFace(i);
-        Material *m = f1->getMaterial();
-        Vec3f p_i = m->getDiffuseColor();
-        
-        int j = max_undistributed_patch;
-        
-        if (i == j) {
-            continue;
+    std::vector<int> shooters;
+    std::vector<float> light[3];
+    if (args->radiosity_sweep == SWEEP_JACOBI) {
+        // every patch shoots the light it had at the start of the sweep
+        for (int j = 0; j < num_faces; ++j) {
+            if (undistributed_heap.getKey(j) == 0) continue;
+            shooters.push_back(j);
+            for (int c = 0; c < 3; c++) {
+                light[c].push_back(undistributed[c][j]);
+                undistributed[c][j] = 0;
+            }
         }
+        ShootAll(shooters,light);
+        findMaxUndistributed();
+    } else if (args->radiosity_sweep == SWEEP_GAUSS_SEIDEL) {
+        // the patches shoot in turn, including the light they received
+        // from the patches before them in this sweep
+        for (int j = 0; j < num_faces; ++j) {
+            float l[3] = { undistributed[0][j], undistributed[1][j], undistributed[2][j] };
+            if (l[0] == 0 && l[1] == 0 && l[2] == 0) continue;
+            for (int c = 0; c < 3; c++) {
+                undistributed[c][j] = 0;
+            }
+            Shoot(j,l,0,num_faces);
+        }
+        findMaxUndistributed();
+    } else {
+        // take the patches with the most undistributed light off the
+        // top of the queue (usually just one) and shoot all their light
+        // at once
+        int num_shooters = std::min(args->num_shooters,num_faces);
+        for (int s = 0; s < num_shooters; ++s) {
+            int j = undistributed_heap.top();
+            if (s > 0 && undistributed_heap.getKey(j) == 0) break;
+            shooters.push_back(j);
+            for (int c = 0; c < 3; c++) {
+                light[c].push_back(undistributed[c][j]);
+                undistributed[c][j] = 0;
+            }
+            updateUndistributed(j);
+        }
+        ShootAll(shooters,light);
         
-        Vec3f ff = formfactors[i * num_faces + j] * getUndistributed(j);
-        
-        setRadiance(i, getRadiance(i) + ff * p_i);
-        setUndistributed(i, getUndistributed(i) + ff * p_i);
-        setAbsorbed(i, getAbsorbed(i) + (Vec3f(1,1,1)-p_i) * ff);
+        // move the receivers to their new places in the queue (when
+        // most of the patches received light, it is cheaper to rebuild it)
+        int num_received = 0;
+        for (unsigned int s = 0; s < shooters.size(); ++s) {
+            num_received += ff_start[shooters[s]+1] - ff_start[shooters[s]];
+        }
+        if (num_received > num_faces/4) {
+            findMaxUndistributed();
+        } else {
+            for (unsigned int s = 0; s < shooters.size(); ++s) {
+                int j = shooters[s];
+                for (int k = ff_start[j]; k < ff_start[j+1]; ++k) {
+                    updateUndistributed(ff_patch[k]);
+                }
+            }
+            max_undistributed_patch = undistributed_heap.top();
+            if (undistributed_heap.getKey(max_undistributed_patch) == 0) {
+                // all done (don't leave the round off of the updates in the total)
+                total_undistributed = 0;
+            }
+        }
     }
     
-    setUndistributed(max_undistributed_patch, Vec3f(0,0,0));
-    
     // return the total light yet undistributed
     // (so we can decide when the solution has sufficiently converged)
-    findMaxUndistributed();
     return total_undistributed;    
 }
 
@@ -208,7 +441,7 @@ Vec3f Radiosity::whichVisualization(enum RENDER_MODE mode, Face *f, int i) {
     } else if (mode == RENDER_RADIANCE) {
         return getRadiance(i);
     } else if (mode == RENDER_FORM_FACTORS) {
-        if (formfactors == NULL) ComputeFormFactors();
+        if (!hasFormFactors()) ComputeFormFactors();
         double scale = 0.2 * total_area/getArea(i);
         double factor = scale * getFormFactor(max_undistributed_patch,i);
         return Vec3f(factor,factor,factor);
@@ -2,8 +2,11 @@
 #define _RADIOSITY_H_
 
 #include <vector>
+#include <algorithm>
+#include <cassert>
 #include "vectors.h"
 #include "argparser.h"
+#include "indexed_heap.h"
 
 class Mesh;
 class Face;
@@ -36,50 +39,46 @@ public:
     // F_i,j radiant energy leaving i arriving at j
     assert (i >= 0 && i < num_faces);
     assert (j >= 0 && j < num_faces);
-    assert (formfactors != NULL);
-    return formfactors[i*num_faces+j]; }
+    assert (hasFormFactors());
+    // the receivers of j are sorted, so look for i with a binary search
+    std::vector<int>::const_iterator first = ff_patch.begin()+ff_start[j];
+    std::vector<int>::const_iterator last = ff_patch.begin()+ff_start[j+1];
+    std::vector<int>::const_iterator k = std::lower_bound(first,last,i);
+    if (k == last || *k != i) return 0;  // negligible (not stored)
+    return ff_value[k-ff_patch.begin()]; }
+  bool hasFormFactors() const { return !ff_start.empty(); }
+  // the number of form factors kept (out of num_faces^2)
+  int numFormFactors() const { return ff_value.size(); }
   double getArea(int i) const {
     assert (i >= 0 && i < num_faces);
     return area[i]; }
   Vec3f getUndistributed(int i) const {
     assert (i >= 0 && i < num_faces);
-    return undistributed[i]; }
+    return Vec3f(undistributed[0][i],undistributed[1][i],undistributed[2][i]); }
   Vec3f getAbsorbed(int i) const {
     assert (i >= 0 && i < num_faces);
-    return absorbed[i]; }
+    return Vec3f(absorbed[0][i],absorbed[1][i],absorbed[2][i]); }
   Vec3f getRadiance(int i) const {
     assert (i >= 0 && i < num_faces);
-    return radiance[i]; }
+    return Vec3f(radiance[0][i],radiance[1][i],radiance[2][i]); }
   
   // =========
   // MODIFIERS
   double Iterate();
-  void setFormFactor(int i, int j, double value) { 
-    assert (i >= 0 && i < num_faces);
-    assert (j >= 0 && j < num_faces);
-    assert (formfactors != NULL);
-    formfactors[i*num_faces+j] = value; }
-  void normalizeFormFactors(int i) {
-    double sum = 0;
-    int j;
-    for (j = 0; j < num_faces; j++) {
-      sum += getFormFactor(i,j); }
-    if (sum == 0) return;
-    for (j = 0; j < num_faces; j++) {
-      setFormFactor(i,j,getFormFactor(i,j)/sum); } }
   void setArea(int i, double value) {
     assert (i >= 0 && i < num_faces);
     area[i] = value; }
   void setUndistributed(int i, Vec3f value) { 
     assert (i >= 0 && i < num_faces);
-    undistributed[i] = value; }
+    for (int c = 0; c < 3; c++) undistributed[c][i] = value[c]; }
+  // rebuild the priority queue of the patches (after setUndistributed)
   void findMaxUndistributed();
   void setAbsorbed(int i, Vec3f value) { 
     assert (i >= 0 && i < num_faces);
-    absorbed[i] = value; }
+    for (int c = 0; c < 3; c++) absorbed[c][i] = value[c]; }
   void setRadiance(int i, Vec3f value) { 
     assert (i >= 0 && i < num_faces);
-    radiance[i] = value; }
+    for (int c = 0; c < 3; c++) radiance[c][i] = value[c]; }
 
   // =====
   // PAINT
@@ -90,6 +89,23 @@ public:
 
 private:
 
+  // HELPER FUNCTIONS
+  // shoot the light (per unit area) of patch j to the receivers
+  // first..last-1 of its column
+  void Shoot(int j, const float light[3], int first, int last);
+  // shoot the light of several patches at once, on all cores (each
+  // thread updates its own range of receivers)
+  void ShootAll(const std::vector<int> &shooters, const std::vector<float> light[3]);
+  // move patch i to its place in the priority queue after its
+  // undistributed light changed (and update the total)
+  void updateUndistributed(int i);
+  // args->num_form_factor_samples points on each patch, stratified
+  void SamplePatches(std::vector<Vec3f> &points) const;
+  // the form factor F_i,j (not normalized) estimated from the sample
+  // points, with visibility
+  double PatchFormFactor(int i, int j, const std::vector<Vec3f> &points,
+                         const std::vector<Vec3f> &normals, long long &num_rays) const;
+
   // ==============
   // REPRESENTATION
   Mesh *mesh;
@@ -98,16 +114,29 @@ private:
   RayTracer *raytracer;
   PhotonMapping *photon_mapping;
 
-  // a nxn matrix
-  // F_i,j radiant energy leaving i arriving at j
-  double *formfactors;
+  // the nxn matrix F_i,j (radiant energy leaving i arriving at j),
+  // stored sparse by column: only the non zero form factors, less the
+  // smallest ones of each row that together carry at most
+  // args->form_factor_threshold of its energy, are kept.  The
+  // patches i with a form factor F_i,j are
+  // ff_patch[ff_start[j]] .. ff_patch[ff_start[j+1]-1] (in increasing
+  // order) and ff_value holds the matching F_i,j.  A column is all
+  // that shooting the light of patch j needs.
+  std::vector<int> ff_start;
+  std::vector<int> ff_patch;
+  std::vector<float> ff_value;
 
   // length n vectors
   double *area;
-  Vec3f *undistributed; // energy per unit area
-  Vec3f *absorbed;      // energy per unit area
-  Vec3f *radiance;      // energy per unit area
+  // (one float array per color channel, so shooting the light of a
+  // patch is a tight loop over plain arrays)
+  std::vector<float> undistributed[3]; // energy per unit area
+  std::vector<float> absorbed[3];      // energy per unit area
+  std::vector<float> radiance[3];      // energy per unit area
+  std::vector<float> reflectance[3];   // the diffuse color of each patch
 
+  // the patches by undistributed energy (times area)
+  IndexedHeap undistributed_heap;
   int max_undistributed_patch;  // the patch with the most undistributed energy
   double total_undistributed;    // the total amount of undistributed light
   double total_area;             // the total area of the scene
@@ -5,39 +5,164 @@
 #include "raytree.h"
 #include "utils.h"
 #include "mesh.h"
+#include "camera.h"
 #include "face.h"
 #include "primitive.h"
 #include "photon_mapping.h"
+#include "bvh.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// ===========================================================================
+// CONSTRUCTOR & DESTRUCTOR
+RayTracer::RayTracer(Mesh *m, ArgParser *a) {
+    mesh = m;
+    args = a;
+    bvh = new BVH(mesh);
+#ifdef _OPENMP
+    ray_counts.resize(omp_get_max_threads());
+#else
+    ray_counts.resize(1);
+#endif
+}
+
+RayTracer::~RayTracer() {
+    delete bvh;
+}
+
+// ===========================================================================
+// RAY COUNTS
+
+RayCounts& RayTracer::ThreadRayCounts() const {
+#ifdef _OPENMP
+    int thread = omp_get_thread_num();
+#else
+    int thread = 0;
+#endif
+    assert (thread >= 0 && thread < (int)ray_counts.size());
+    return ray_counts[thread];
+}
+
+RayCounts RayTracer::getRayCounts() const {
+    RayCounts total;
+    for (unsigned int t = 0; t < ray_counts.size(); t++) {
+        total.cast += ray_counts[t].cast;
+        total.occluded += ray_counts[t].occluded;
+        total.traced += ray_counts[t].traced;
+    }
+    return total;
+}
+
+void RayTracer::ResetRayCounts() {
+    ray_counts.assign(ray_counts.size(), RayCounts());
+}
 
 // ===========================================================================
 // casts a single ray through the scene geometry and finds the closest hit
 bool RayTracer::CastRay(Ray &ray, Hit &h, bool use_rasterized_patches) const {
-    bool answer = false;
-    
-    // intersect each of the true quads 
-    for (int i = 0; i < mesh->numOriginalQuads(); i++) {
-        Face *f = mesh->getOriginalQuad(i);
-        if (f->intersect(ray,h,args->intersect_backfacing)) answer = true;
-    }
+    // intersect the true quads and either the rasterized patches or the
+    // original primitives, using the bounding volume hierarchy
+    ThreadRayCounts().cast++;
+    return bvh->CastRay(ray,h,use_rasterized_patches,args->intersect_backfacing);
+}
+
+// ===========================================================================
+// is anything (quads or primitives) between the two points?  stops at
+// the first blocker, and ignores anything at or beyond the target
+// (e.g., the light source itself)
+bool RayTracer::Occluded(const Vec3f &origin, const Vec3f &target, bool use_sphere_patches) const {
+    Vec3f dir = target - origin;
+    double dist = dir.Length();
+    if (dist <= EPSILON) return false;
+    dir.Normalize();
+    Ray ray(origin, dir);
+    ThreadRayCounts().occluded++;
+    // the back side of a wall blocks light just as well as the front
+    return bvh->Occluded(ray, dist - EPSILON, use_sphere_patches, true);
+}
+
+// ===========================================================================
+// trace a ray through pixel (i,j) of the image and return the color
+Vec3f RayTracer::TracePixel(int i, int j) const {
+    // compute and set the pixel color
+    int max_d = std::max(args->width,args->height);
+    // each pixel has its own random stream
+    Sampler sampler(args->random_seed, SAMPLER_PIXELS, j*args->width+i);
     
-    // intersect each of the primitives (either the patches, or the original primitives)
-    if (use_rasterized_patches) {
-        for (int i = 0; i < mesh->numRasterizedPrimitiveFaces(); i++) {
-            Face *f = mesh->getRasterizedPrimitiveFace(i);
-            if (f->intersect(ray,h,args->intersect_backfacing)) answer = true;
-        }
+    if (args->num_antialias_samples <= 1) {
+        assert (i >= 0 && i < args->width);
+        assert (j >= 0 && j < args->height);
+        // convert integer pixel coordinates from (0,1)->(width-1,height-1)
+        // into floating point coordinates (0,0)->(1,1)
+        double x = (i+0.5-args->width/2.0)/double(max_d)+0.5;
+        double y = (j+0.5-args->height/2.0)/double(max_d)+0.5;
+        assert (x >= 0.0 && x <= 1.0);
+        assert (y >= 0.0 && y <= 1.0);
+        Ray r = mesh->getCamera()->generateRay(x,y);
+        Hit hit;
+        Vec3f color = TraceRay(r,hit,sampler);
+        RayTree::AddMainSegment(r,0,hit.getT());
+        return color;
     } else {
-        int num_primitives = mesh->numPrimitives();
-        for (int i = 0; i < num_primitives; i++) {
-            if (mesh->getPrimitive(i)->intersect(ray,h)) answer = true;
+        // ==========================================
+        // ASSIGNMENT:  IMPLEMENT ANTIALIASING
+        // ==========================================
+        Vec3f color;
+        
+        int N = args->num_antialias_samples;
+        
+        for (int h = 0; h < N; ++h) {
+            assert (i >= 0 && i < args->width);
+            assert (j >= 0 && j < args->height);
+            
+            double rand = sampler.rand();
+            double rotation = 2 * M_PI * rand;
+            
+            double away = (double)h / N;
+            double around = h * rotation;
+            
+            // convert integer pixel coordinates from (0,1)->(width-1,height-1)
+            // into floating point coordinates (0,0)->(1,1)
+            double I = i;
+            double J = j;
+            
+            I += (std::cos(around) / 1.0) * away;
+            J += (std::sin(around) / 1.0) * away;
+            
+            double x = (I+0.5-args->width/2.0)/double(max_d)+0.5;
+            double y = (J+0.5-args->height/2.0)/double(max_d)+0.5;
+            
+            if (x < 0.0) {
+                x = 0.0;
+            } else if (x > 1.0) {
+                x = 1.0;
+            }
+            if (y < 0.0) {
+                y = 0.0;
+            } else if (y > 1.0) {
+                y = 1.0;
+            }
+            Ray r = mesh->getCamera()->generateRay(x,y);
+            Hit hit;
+            color += TraceRay(r,hit,sampler) * rand;
+            RayTree::AddMainSegment(r,0,hit.getT());
+            //return color;
         }
+        
+        color /= N;
+       
+        // return the average color
+        return color;        
     }
-    return answer;
 }
 
 // ===========================================================================
 // does the recursive (shadow rays & recursive rays) work
-Vec3f RayTracer::TraceRay(Ray &ray, Hit &hit, int bounce_count) const {
+Vec3f RayTracer::TraceRay(Ray &ray, Hit &hit, Sampler &sampler, int bounce_count) const {
+    
+    ThreadRayCounts().traced++;
     
     // First cast a ray and see if we hit anything.
     hit = Hit();
@@ -88,66 +213,27 @@ Vec3f RayTracer::TraceRay(Ray &ray, Hit &hit, int bounce_count) const {
         lightColor /= M_PI*dist*dist;
        
         if (args->num_shadow_samples == 1) {
-            Ray lightRay(point, dirToLight);
-            
-            bool allClear = true;
-            
-            int num_primitives = mesh->numPrimitives();
-            for (int j = 0; j < num_primitives; ++j) {
-                Primitive *p = mesh->getPrimitive(j);
-                Hit lightHit;
-                if (p->intersect(lightRay,lightHit)) {
-                    // Hit.  Now check to see if it's between us and our light source
-                    Vec3f shadowRayPoint = lightRay.pointAtParameter(lightHit.getT());
-                    Vec3f shadowRayVec = pointOnLight - shadowRayPoint;
-                    double x = shadowRayVec.Length();
-                    if (x < dist) {
-                        allClear = false;
-                        shadowRayVec.Normalize();
-                        RayTree::AddShadowSegment(Ray(shadowRayPoint, shadowRayVec), 0, dist);
-                        break;
-                    }
-                }
-            }
-            
-            if (allClear) {
+            // (only the blocked shadow rays are drawn)
+            if (Occluded(point, pointOnLight, false)) {
+                RayTree::AddShadowSegment(Ray(point, dirToLight), 0, dist);
+            } else {
                 answer += m->Shade(ray,hit,dirToLight,lightColor,args);
             }
         }
         else if (args->num_shadow_samples > 1) {
             Vec3f tempAnswer;
             for (int s = 0; s < args->num_shadow_samples; ++s) {
-                Vec3f newPoint = f->RandomPoint();
+                Vec3f newPoint = f->RandomPoint(sampler);
                 Vec3f dir = newPoint - point;
                 dist = dir.Length();
                 dir.Normalize();
+                if (Occluded(point, newPoint, false)) {
+                    RayTree::AddShadowSegment(Ray(point, dir), 0, dist);
+                    continue;
+                }
                 lightColor = f->getMaterial()->getEmittedColor() * f->getArea();
                 lightColor /= M_PI*dist*dist;
-                Ray lightRay(point, dir);
-                
-                bool allClear = true;
-                
-                int num_primitives = mesh->numPrimitives();
-                for (int j = 0; j < num_primitives; ++j) {
-                    Primitive *p = mesh->getPrimitive(j);
-                    Hit lightHit;
-                    if (p->intersect(lightRay,lightHit)) {
-                        // Hit.  Now check to see if it's between us and our light source
-                        Vec3f shadowRayPoint = lightRay.pointAtParameter(lightHit.getT());
-                        Vec3f shadowRayVec = pointOnLight - shadowRayPoint;
-                        double x = shadowRayVec.Length();
-                        if (x < dist) {
-                            allClear = false;
-                            shadowRayVec.Normalize();
-                            RayTree::AddShadowSegment(Ray(shadowRayPoint, shadowRayVec), 0, dist);
-                            //break;
-                        }
-                    }
-                }
-                
-                if (allClear) {
-                    tempAnswer += m->Shade(ray,hit,dirToLight,lightColor,args);
-                }
+                tempAnswer += m->Shade(ray,hit,dir,lightColor,args);
             }
             tempAnswer /= args->num_shadow_samples;
             answer += tempAnswer;
@@ -178,7 +264,7 @@ Vec3f RayTracer::TraceRay(Ray &ray, Hit &hit, int bounce_count) const {
         //R_dir *= -1.0;
         Ray R(point, R_dir);
         Hit nHit;
-        answer += TraceRay(R, nHit, bounce_count+1) * reflectiveColor;
+        answer += TraceRay(R, nHit, sampler, bounce_count+1) * reflectiveColor;
         RayTree::AddReflectedSegment(R, 0, nHit.getT());
     }
     
@@ -5,11 +5,26 @@
 #include <vector>
 #include "ray.h"
 #include "hit.h"
+#include "sampler.h"
+#include "utils.h"
 
 class Mesh;
 class ArgParser;
 class Radiosity;
 class PhotonMapping;
+class BVH;
+
+// ====================================================================
+// (for benchmarking) the rays cast by one thread, by kind: closest hit
+// (CastRay), shadow (Occluded) and shaded (TraceRay)
+
+class alignas(CACHE_LINE_SIZE) RayCounts {
+public:
+  RayCounts() : cast(0), occluded(0), traced(0) {}
+  long long cast;
+  long long occluded;
+  long long traced;
+};
 
 // ====================================================================
 // ====================================================================
@@ -19,27 +34,42 @@ class RayTracer {
 public:
 
   // CONSTRUCTOR & DESTRUCTOR
-  RayTracer(Mesh *m, ArgParser *a) {
-    mesh = m;
-    args = a;
-  }  
+  // (the mesh must be loaded, the acceleration structure is built here)
+  RayTracer(Mesh *m, ArgParser *a);
+  ~RayTracer();
   // set access to the other modules for hybrid rendering options
   void setRadiosity(Radiosity *r) { radiosity = r; }
   void setPhotonMapping(PhotonMapping *pm) { photon_mapping = pm; }
   
   // casts a single ray through the scene geometry and finds the closest hit
   bool CastRay(Ray &ray, Hit &h, bool use_sphere_patches) const;
+  // closest hit for photon tracing: just the geometry (the hit's
+  // material, primitive, normal & exit distance), no shading
+  bool CastPhoton(Ray &ray, Hit &h) const { return CastRay(ray,h,false); }
+  // any-hit query for shadow rays: is the segment between the two points blocked?
+  bool Occluded(const Vec3f &origin, const Vec3f &target, bool use_sphere_patches) const;
+
+  // does the recursive work (random samples are drawn from the sampler)
+  Vec3f TraceRay(Ray &ray, Hit &hit, Sampler &sampler, int bounce_count = 0) const;
+  // the (antialiased) color of pixel (i,j) of the args->width x args->height image
+  Vec3f TracePixel(int i, int j) const;
 
-  // does the recursive work
-  Vec3f TraceRay(Ray &ray, Hit &hit, int bounce_count = 0) const;
+  // the rays cast (by all threads) since the last reset
+  RayCounts getRayCounts() const;
+  void ResetRayCounts();
 
 private:
 
+  RayCounts& ThreadRayCounts() const;
+
   // REPRESENTATION
   Mesh *mesh;
+  BVH *bvh;
   ArgParser *args;
   Radiosity *radiosity;
   PhotonMapping *photon_mapping;
+  // one entry per thread, so counting needs no locking
+  mutable std::vector<RayCounts,CacheLineAllocator<RayCounts> > ray_counts;
 };
 
 // ====================================================================
@@ -0,0 +1,56 @@
+#ifndef _SAMPLER_H_
+#define _SAMPLER_H_
+
+#include <cassert>
+
+// ====================================================================
+// A counter-based random number stream.  Each stream is identified by
+// a seed, a domain (photons, pixels, ...) and an index within that
+// domain (e.g., the number of the photon being shot or the pixel
+// being rendered).  The n-th number of a stream is a hash of its key
+// and n, so streams are independent of each other and of the order
+// in which they are evaluated, which makes the results repeatable
+// regardless of the number of threads.  A Sampler is small and meant
+// to be created on the stack, one per photon or pixel.
+// ====================================================================
+
+enum SAMPLER_DOMAIN { SAMPLER_PHOTONS, SAMPLER_PIXELS, SAMPLER_FORM_FACTORS };
+
+class Sampler {
+
+public:
+
+  typedef unsigned long long uint64;
+
+  // CONSTRUCTOR
+  Sampler(uint64 seed, enum SAMPLER_DOMAIN domain, uint64 index) {
+    key = Mix(Mix(seed) ^ Mix(((uint64)domain << 56) ^ index));
+    counter = 0; }
+
+  // ACCESSORS
+  uint64 getPosition() const { return counter; }
+
+  // MODIFIERS
+  // jump to the n-th number of the stream
+  void Seek(uint64 n) { counter = n; }
+  // random integer in [0,2^64)
+  uint64 randInt() { return Mix(key + GOLDEN_GAMMA * ++counter); }
+  // random real in [0,1)
+  double rand() { return (randInt() >> 11) * (1.0 / 9007199254740992.0); }
+
+private:
+
+  // the splitmix64 finalizer: a bijective mix with good avalanche
+  static uint64 Mix(uint64 z) {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31); }
+
+  static const uint64 GOLDEN_GAMMA = 0x9e3779b97f4a7c15ULL;
+
+  // REPRESENTATION
+  uint64 key;
+  uint64 counter;
+};
+
+#endif
@@ -0,0 +1,232 @@
+#include <cstdio>
+#include <cstring>
+#include <cassert>
+#include <sys/stat.h>
+#include "scene_cache.h"
+#include "argparser.h"
+#include "bvh.h"
+
+// the start of the cache file
+class SceneCacheHeader {
+public:
+  char magic[8];
+  unsigned int version;
+  unsigned int real_size;  // the geometry precision of the build that wrote it
+  unsigned long long source_size;
+  unsigned long long source_hash;
+  int num_vertices;
+  int num_quads;
+  unsigned long long records_size;  // the records follow the header
+  unsigned long long bvh_size;      // and the BVH (if any) follows the records
+};
+
+// the start of the BVH section, followed by the item order & the nodes
+class BVHCacheHeader {
+public:
+  // the rasterization of the primitives (it changes the items)
+  int sphere_horiz;
+  int sphere_vert;
+  int cylinder_ring_rasterization;
+  int num_items;
+  int num_nodes;
+  int node_size;
+};
+
+static const char scene_cache_magic[8] = { 'S','C','E','N','E','$','$','\0' };
+
+// 8 bytes at a time
+unsigned long long SceneCache::Hash(const char *data, size_t n) {
+  unsigned long long h = 0x9e3779b97f4a7c15ULL ^ n;
+  for (size_t i = 0; i < n; i += 8) {
+    unsigned long long w = 0;
+    memcpy(&w, data+i, (n-i < 8) ? n-i : 8);
+    // (the splitmix64 finalizer)
+    h ^= w;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+  }
+  return h;
+}
+
+static bool HasText(int type) {
+  return type == SCENE_CAMERA || type == SCENE_MATERIAL;
+}
+
+// ====================================================================
+
+SceneCache::SceneCache(const std::string &obj_file, size_t size, unsigned long long hash, ArgParser *a) {
+  filename = obj_file + ".cache";
+  args = a;
+  source_size = size;
+  source_hash = hash;
+  num_vertices = 0;
+  num_quads = 0;
+  records = records_end = next_record = NULL;
+  bvh = NULL;
+  bvh_size = 0;
+}
+
+// ====================================================================
+// READING
+// ====================================================================
+
+bool SceneCache::Open() {
+  struct stat st;
+  if (stat(filename.c_str(),&st) != 0) return false;
+  if (!file.Open(filename)) return false;
+  SceneCacheHeader header;
+  bool ok = file.size() >= sizeof(header);
+  if (ok) {
+    memcpy(&header, file.getData(), sizeof(header));
+    ok = memcmp(header.magic,scene_cache_magic,sizeof(header.magic)) == 0 &&
+      header.version == SCENE_CACHE_VERSION &&
+      header.real_size == sizeof(real) &&
+      header.source_size == source_size &&
+      header.source_hash == source_hash &&
+      sizeof(header) + header.records_size + header.bvh_size == file.size();
+  }
+  if (!ok) {
+    printf ("scene cache %s is out of date\n", filename.c_str());
+    file.Close();
+    return false;
+  }
+  num_vertices = header.num_vertices;
+  num_quads = header.num_quads;
+  records = next_record = file.getData() + sizeof(header);
+  records_end = records + header.records_size;
+  bvh = (header.bvh_size > 0) ? records_end : NULL;
+  bvh_size = header.bvh_size;
+  printf ("using scene cache %s\n", filename.c_str());
+  return true;
+}
+
+bool SceneCache::Read(SceneRecord &r) {
+  assert (records != NULL);
+  if (next_record == records_end) return false;
+  assert (next_record + 2 <= records_end);
+  r.type = (enum SCENE_RECORD_TYPE)(unsigned char)next_record[0];
+  r.num_values = (unsigned char)next_record[1];
+  next_record += 2;
+  assert (r.num_values <= 12);
+  assert (next_record + r.num_values*sizeof(double) <= records_end);
+  memcpy(r.values, next_record, r.num_values*sizeof(double));
+  next_record += r.num_values*sizeof(double);
+  if (HasText(r.type)) {
+    unsigned int length;
+    assert (next_record + sizeof(length) <= records_end);
+    memcpy(&length, next_record, sizeof(length));
+    next_record += sizeof(length);
+    assert (next_record + length <= records_end);
+    r.text.assign(next_record,length);
+    next_record += length;
+  }
+  return true;
+}
+
+bool SceneCache::getBVH(int num_items, std::vector<BVHNode> &nodes, std::vector<int> &item_order) const {
+  if (bvh == NULL) return false;
+  BVHCacheHeader header;
+  if (bvh_size < sizeof(header)) return false;
+  memcpy(&header, bvh, sizeof(header));
+  if (header.sphere_horiz != args->sphere_horiz ||
+      header.sphere_vert != args->sphere_vert ||
+      header.cylinder_ring_rasterization != args->cylinder_ring_rasterization ||
+      header.num_items != num_items ||
+      header.node_size != (int)sizeof(BVHNode) ||
+      bvh_size != sizeof(header) + num_items*sizeof(int) + header.num_nodes*sizeof(BVHNode)) {
+    return false;
+  }
+  const char *p = bvh + sizeof(header);
+  item_order.resize(num_items);
+  if (num_items > 0) memcpy(&item_order[0], p, num_items*sizeof(int));
+  p += num_items*sizeof(int);
+  // it must be a permutation of the items
+  std::vector<bool> seen(num_items,false);
+  for (int i = 0; i < num_items; i++) {
+    int k = item_order[i];
+    if (k < 0 || k >= num_items || seen[k]) return false;
+    seen[k] = true;
+  }
+  nodes.resize(header.num_nodes);
+  if (header.num_nodes > 0) memcpy(&nodes[0], p, header.num_nodes*sizeof(BVHNode));
+  return true;
+}
+
+// ====================================================================
+// WRITING
+// ====================================================================
+
+void SceneCache::Write(const SceneRecord &r) {
+  assert (!file.isOpen());
+  assert (r.num_values >= 0 && r.num_values <= 12);
+  stream.push_back((char)r.type);
+  stream.push_back((char)r.num_values);
+  const char *values = (const char*)r.values;
+  stream.insert(stream.end(), values, values + r.num_values*sizeof(double));
+  if (HasText(r.type)) {
+    unsigned int length = r.text.size();
+    const char *l = (const char*)&length;
+    stream.insert(stream.end(), l, l + sizeof(length));
+    stream.insert(stream.end(), r.text.begin(), r.text.end());
+  }
+  if (r.type == SCENE_VERTEX) num_vertices++;
+  if (r.type == SCENE_QUAD) num_quads++;
+}
+
+void SceneCache::setBVH(const std::vector<BVHNode> &nodes, const std::vector<int> &item_order) {
+  BVHCacheHeader header;
+  header.sphere_horiz = args->sphere_horiz;
+  header.sphere_vert = args->sphere_vert;
+  header.cylinder_ring_rasterization = args->cylinder_ring_rasterization;
+  header.num_items = item_order.size();
+  header.num_nodes = nodes.size();
+  header.node_size = sizeof(BVHNode);
+  bvh_stream.resize(sizeof(header) + item_order.size()*sizeof(int) + nodes.size()*sizeof(BVHNode));
+  char *p = &bvh_stream[0];
+  memcpy(p, &header, sizeof(header));
+  p += sizeof(header);
+  if (!item_order.empty()) memcpy(p, &item_order[0], item_order.size()*sizeof(int));
+  p += item_order.size()*sizeof(int);
+  if (!nodes.empty()) memcpy(p, &nodes[0], nodes.size()*sizeof(BVHNode));
+  bvh = &bvh_stream[0];
+  bvh_size = bvh_stream.size();
+}
+
+bool SceneCache::Save() {
+  const char *r = file.isOpen() ? records : (stream.empty() ? NULL : &stream[0]);
+  size_t records_size = file.isOpen() ? records_end - records : stream.size();
+  SceneCacheHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, scene_cache_magic, sizeof(header.magic));
+  header.version = SCENE_CACHE_VERSION;
+  header.real_size = sizeof(real);
+  header.source_size = source_size;
+  header.source_hash = source_hash;
+  header.num_vertices = num_vertices;
+  header.num_quads = num_quads;
+  header.records_size = records_size;
+  header.bvh_size = bvh_size;
+
+  // write a temporary file & rename it, so a reader never maps half a
+  // cache (and the one we may have mapped stays valid)
+  std::string tmp = filename + ".tmp";
+  FILE *f = fopen(tmp.c_str(),"wb");
+  if (f == NULL) {
+    printf ("WARNING: cannot write scene cache %s\n", filename.c_str());
+    return false;
+  }
+  bool ok = fwrite(&header,sizeof(header),1,f) == 1;
+  if (ok && records_size > 0) ok = fwrite(r,records_size,1,f) == 1;
+  if (ok && bvh_size > 0) ok = fwrite(bvh,bvh_size,1,f) == 1;
+  ok = (fclose(f) == 0) && ok;
+  if (!ok || rename(tmp.c_str(),filename.c_str()) != 0) {
+    printf ("WARNING: cannot write scene cache %s\n", filename.c_str());
+    remove(tmp.c_str());
+    return false;
+  }
+  printf ("wrote scene cache %s\n", filename.c_str());
+  return true;
+}
+
+// ====================================================================
@@ -0,0 +1,105 @@
+#ifndef _SCENE_CACHE_H_
+#define _SCENE_CACHE_H_
+
+#include <string>
+#include <vector>
+#include "mapped_file.h"
+
+class ArgParser;
+class BVHNode;
+
+// bump this whenever the layout of the cache file (or of BVHNode), or
+// the way the BVH is built, changes
+#define SCENE_CACHE_VERSION 2
+
+enum SCENE_RECORD_TYPE { SCENE_VERTEX, SCENE_TEXTURE_COORDINATES, SCENE_QUAD, SCENE_SPHERE,
+                         SCENE_CYLINDER_RING, SCENE_BACKGROUND_COLOR, SCENE_CAMERA,
+                         SCENE_SELECT_MATERIAL, SCENE_MATERIAL };
+
+// one statement of the .obj file: its numbers, and the texture file of
+// a material or the text of a camera block
+class SceneRecord {
+public:
+  enum SCENE_RECORD_TYPE type;
+  int num_values;
+  double values[12];
+  std::string text;
+};
+
+// ====================================================================
+// A binary copy of a parsed .obj file, kept next to it (foo.obj ->
+// foo.obj.cache).  It holds the statements of the file as records (add
+// this vertex, this quad, use this material, ...) in the order Mesh::Load
+// met them, so replaying them builds exactly the same mesh, without
+// parsing any text.  It can also hold the BVH built over the scene (the
+// nodes and the order of the items).  The topology is not cached:
+// replaying still builds the half edges, the rasterized primitive
+// faces & the bounding box.
+//
+// The cache is memory mapped and only used when its version, the
+// precision of the build and the size & hash of the .obj all match
+// (and, for the BVH, the rasterization of the primitives); otherwise
+// it is written again, once, by the BVH after adding its tree.
+// ====================================================================
+
+class SceneCache {
+
+public:
+
+  // CONSTRUCTOR
+  // the cache of the .obj file with this size & hash (of its text)
+  SceneCache(const std::string &obj_file, size_t source_size, unsigned long long source_hash, ArgParser *args);
+
+  // a hash of the text of a file (it identifies the scene)
+  static unsigned long long Hash(const char *data, size_t n);
+
+  // ACCESSORS
+  const std::string& getFilename() const { return filename; }
+  // (for pre-sizing) the numbers of vertex & quad records
+  int numVertices() const { return num_vertices; }
+  int numQuads() const { return num_quads; }
+
+  // READING
+  // map the cache file, true if it exists and matches the .obj
+  bool Open();
+  // the next record, false after the last one
+  bool Read(SceneRecord &r);
+  // the BVH in the cache, if there is one for these num_items items
+  bool getBVH(int num_items, std::vector<BVHNode> &nodes, std::vector<int> &item_order) const;
+
+  // WRITING
+  // append a record (while parsing the .obj)
+  void Write(const SceneRecord &r);
+  // the tree to save with the records: item_order[i] is the index the
+  // i-th item of the tree had before the build
+  void setBVH(const std::vector<BVHNode> &nodes, const std::vector<int> &item_order);
+  // write the cache file, returns false (and prints why) on failure
+  bool Save();
+
+private:
+
+  // REPRESENTATION
+  std::string filename;
+  ArgParser *args;
+  unsigned long long source_size;
+  unsigned long long source_hash;
+  int num_vertices;
+  int num_quads;
+
+  // the records: either read from the mapped cache file, or written
+  // to the stream
+  MappedFile file;
+  const char *records;
+  const char *records_end;
+  const char *next_record;
+  std::vector<char> stream;
+
+  // the BVH section (in the mapped file, or set to be saved)
+  const char *bvh;
+  size_t bvh_size;
+  std::vector<char> bvh_stream;
+};
+
+// ====================================================================
+
+#endif
@@ -19,6 +19,9 @@ public:
     
     // for ray tracing
     virtual bool intersect(const Ray &r, Hit &h) const;
+    BoundingBox getBoundingBox() const {
+        Vec3f r(radius,radius,radius);
+        return BoundingBox(center-r,center+r); }
     
     // for OpenGL rendering & radiosity
     void addRasterizedFaces(Mesh *m, ArgParser *args);
@@ -0,0 +1,80 @@
+#include <algorithm>
+#include <vector>
+#include "tile_renderer.h"
+#include "argparser.h"
+#include "raytracer.h"
+#include "utils.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// the tiles owned by one thread, [next,end).  Both the owner and the
+// thieves take tiles from the front.  Padded to its own cache line so
+// the counters of different threads don't share one.
+class TileRange {
+public:
+  int next;
+  int end;
+  char padding[64-2*sizeof(int)];
+};
+
+// ====================================================================
+
+int TileRenderer::Render(Image &image) const {
+  image.Allocate(args->width,args->height);
+  int num_tiles = numTiles();
+  std::vector<TileRange> ranges;
+  int stolen = 0;
+
+#pragma omp parallel reduction(+:stolen)
+  {
+#ifdef _OPENMP
+    int num_threads = omp_get_num_threads();
+    int me = omp_get_thread_num();
+#else
+    int num_threads = 1;
+    int me = 0;
+#endif
+    // deal out the tiles in contiguous blocks
+#pragma omp single
+    {
+      ranges.resize(num_threads);
+      for (int t = 0; t < num_threads; t++) {
+        ranges[t].next = (long long)num_tiles * t / num_threads;
+        ranges[t].end = (long long)num_tiles * (t+1) / num_threads;
+      }
+    }
+    // work through our own tiles first, then steal from the others
+    for (int k = 0; k < num_threads; k++) {
+      TileRange &range = ranges[(me+k) % num_threads];
+      while (true) {
+        int tile;
+#pragma omp atomic capture
+        tile = range.next++;
+        if (tile >= range.end) break;
+        RenderTile(tile,image);
+        if (k > 0) stolen++;
+      }
+    }
+  }
+  return stolen;
+}
+
+void TileRenderer::RenderTile(int tile, Image &image) const {
+  int x0 = (tile % numTilesX()) * TILE_SIZE;
+  int y0 = (tile / numTilesX()) * TILE_SIZE;
+  int x1 = std::min(x0+TILE_SIZE,args->width);
+  int y1 = std::min(y0+TILE_SIZE,args->height);
+  for (int j = y0; j < y1; j++) {
+    for (int i = x0; i < x1; i++) {
+      Vec3f color = raytracer->TracePixel(i,j);
+      int r = int(255*std::max(0.0,std::min(1.0,linear_to_srgb(color.r()))));
+      int g = int(255*std::max(0.0,std::min(1.0,linear_to_srgb(color.g()))));
+      int b = int(255*std::max(0.0,std::min(1.0,linear_to_srgb(color.b()))));
+      image.SetPixel(i,j,Color(r,g,b));
+    }
+  }
+}
+
+// ====================================================================
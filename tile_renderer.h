@@ -0,0 +1,50 @@
+#ifndef _TILE_RENDERER_H_
+#define _TILE_RENDERER_H_
+
+#include "image.h"
+#include "argparser.h"
+
+class RayTracer;
+
+// width & height of a tile in pixels
+#define TILE_SIZE 16
+
+// ====================================================================
+// Renders the full args->width x args->height frame into an Image,
+// using all cores.  The frame is cut into TILE_SIZE x TILE_SIZE tiles
+// and each thread starts with its own contiguous range of tiles; a
+// thread that finishes its range steals the remaining tiles of the
+// other threads.  Each pixel has its own random stream (see
+// RayTracer::TracePixel), so the image does not depend on the number
+// of threads or on which thread rendered which tile.
+// ====================================================================
+
+class TileRenderer {
+
+public:
+
+  // CONSTRUCTOR
+  TileRenderer(RayTracer *r, ArgParser *a) : raytracer(r), args(a) {}
+
+  // ACCESSORS
+  int numTilesX() const { return (args->width+TILE_SIZE-1)/TILE_SIZE; }
+  int numTilesY() const { return (args->height+TILE_SIZE-1)/TILE_SIZE; }
+  int numTiles() const { return numTilesX()*numTilesY(); }
+
+  // trace every pixel (the image is resized to fit), returns the
+  // number of tiles that were stolen from another thread
+  int Render(Image &image) const;
+
+private:
+
+  // HELPER FUNCTIONS
+  void RenderTile(int tile, Image &image) const;
+
+  // REPRESENTATION
+  RayTracer *raytracer;
+  ArgParser *args;
+};
+
+// ====================================================================
+
+#endif
@@ -0,0 +1,198 @@
+#include <cmath>
+#include "triangle_buffer.h"
+#include "face.h"
+#include "ray.h"
+#include "hit.h"
+#include "utils.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TRIANGLE_SIMD
+#endif
+
+// below this determinant the filter leaves the decision to Intersect
+// (which rejects |det| <= 0.000001)
+#define FILTER_DET_EPSILON 1e-4f
+// slack on the barycentric coordinates, far more than the float
+// round off (Intersect uses 0.00001)
+#define FILTER_TOLERANCE 1e-2f
+
+enum TRIANGLE_KERNEL TriangleBuffer::kernel = TriangleBuffer::DetectKernel();
+
+FloatRay::FloatRay(const Ray &r) {
+  for (int i = 0; i < 3; i++) {
+    origin[i] = r.getOrigin()[i];
+    direction[i] = r.getDirection()[i];
+  }
+}
+
+// ====================================================================
+
+int TriangleBuffer::AddQuad(const Face *f) {
+  int first = numTriangles();
+  Unpad();
+  Vec3f n = f->computeNormal();
+  double plane_d = n.Dot3((*f)[0]->get());
+  Vertex *v[4] = { (*f)[0], (*f)[1], (*f)[2], (*f)[3] };
+  // the two triangles (a,b,c) & (a,c,d)
+  for (int k = 1; k <= 2; k++) {
+    const Vertex *a = v[0];
+    const Vertex *b = v[k];
+    const Vertex *c = v[k+1];
+    for (int i = 0; i < 3; i++) {
+      corner[i].push_back(a->get()[i]);
+      edge1[i].push_back(b->get()[i]-a->get()[i]);
+      edge2[i].push_back(c->get()[i]-a->get()[i]);
+      normal[i].push_back(n[i]);
+    }
+    s[0].push_back(a->get_s());  t[0].push_back(a->get_t());
+    s[1].push_back(b->get_s());  t[1].push_back(b->get_t());
+    s[2].push_back(c->get_s());  t[2].push_back(c->get_t());
+    d.push_back(plane_d);
+    materials.push_back(f->getMaterial());
+  }
+  Pad();
+  return first;
+}
+
+void TriangleBuffer::Pad() {
+  for (int i = 0; i < 3; i++) {
+    corner[i].resize(numTriangles()+TRIANGLE_BLOCK_SIZE,0);
+    edge1[i].resize(numTriangles()+TRIANGLE_BLOCK_SIZE,0);
+    edge2[i].resize(numTriangles()+TRIANGLE_BLOCK_SIZE,0);
+  }
+}
+
+void TriangleBuffer::Unpad() {
+  for (int i = 0; i < 3; i++) {
+    corner[i].resize(numTriangles());
+    edge1[i].resize(numTriangles());
+    edge2[i].resize(numTriangles());
+  }
+}
+
+// ====================================================================
+
+bool TriangleBuffer::Intersect(int i, const Ray &r, Hit &h, bool intersect_backfacing) const {
+  assert (i >= 0 && i < numTriangles());
+  const Vec3f &o = r.getOrigin();
+  const Vec3f &dir = r.getDirection();
+
+  // the plane of the quad first (see Face::plane_intersect)
+  double denom = dir.x()*normal[0][i] + dir.y()*normal[1][i] + dir.z()*normal[2][i];
+  if (denom == 0) return false;  // parallel to plane
+  if (!intersect_backfacing && denom >= 0) return false;  // hit the backside
+  double numer = d[i] - (o.x()*normal[0][i] + o.y()*normal[1][i] + o.z()*normal[2][i]);
+  double hit_t = numer / denom;
+  if (!(hit_t > EPSILON && hit_t < h.getT())) return false;
+
+  // then the barycentric coordinates (Moller-Trumbore, this gives the
+  // same beta & gamma as solving the 3x3 system with Cramer's rule)
+  double e1[3] = { edge1[0][i], edge1[1][i], edge1[2][i] };
+  double e2[3] = { edge2[0][i], edge2[1][i], edge2[2][i] };
+  double p[3] = { dir.y()*e2[2] - dir.z()*e2[1],
+                  dir.z()*e2[0] - dir.x()*e2[2],
+                  dir.x()*e2[1] - dir.y()*e2[0] };
+  double det = e1[0]*p[0] + e1[1]*p[1] + e1[2]*p[2];
+  if (fabs(det) <= 0.000001) return false;
+  double inv_det = 1.0 / det;
+  double tv[3] = { o.x()-corner[0][i], o.y()-corner[1][i], o.z()-corner[2][i] };
+  double beta = (tv[0]*p[0] + tv[1]*p[1] + tv[2]*p[2]) * inv_det;
+  if (beta < -0.00001 || beta > 1.00001) return false;
+  double q[3] = { tv[1]*e1[2] - tv[2]*e1[1],
+                  tv[2]*e1[0] - tv[0]*e1[2],
+                  tv[0]*e1[1] - tv[1]*e1[0] };
+  double gamma = (dir.x()*q[0] + dir.y()*q[1] + dir.z()*q[2]) * inv_det;
+  if (gamma < -0.00001 || gamma > 1.00001 || beta + gamma > 1.00001) return false;
+
+  h.set(hit_t,materials[i],Vec3f(normal[0][i],normal[1][i],normal[2][i]));
+  h.setT2(hit_t);
+  // interpolate the texture coordinates
+  double alpha = 1 - beta - gamma;
+  h.setTextureCoords(alpha*s[0][i] + beta*s[1][i] + gamma*s[2][i],
+                     alpha*t[0][i] + beta*t[1][i] + gamma*t[2][i]);
+  return true;
+}
+
+// ====================================================================
+// SIMD KERNELS
+// ====================================================================
+
+// Moller-Trumbore for a block of triangles against one ray, written
+// once for both vector widths.  V is the vector type and the macros
+// map to the intrinsics of that width.
+#define FILTER_BODY(V, LOAD, SET1, ADD, SUB, MUL, DIV, AND, ANDNOT, OR, LT, GE, LE, MOVEMASK) \
+  V e1x = LOAD(&edge1[0][i]), e1y = LOAD(&edge1[1][i]), e1z = LOAD(&edge1[2][i]); \
+  V e2x = LOAD(&edge2[0][i]), e2y = LOAD(&edge2[1][i]), e2z = LOAD(&edge2[2][i]); \
+  V dx = SET1(r.direction[0]), dy = SET1(r.direction[1]), dz = SET1(r.direction[2]); \
+  /* p = d x e2, det = e1 . p */ \
+  V px = SUB(MUL(dy,e2z),MUL(dz,e2y)); \
+  V py = SUB(MUL(dz,e2x),MUL(dx,e2z)); \
+  V pz = SUB(MUL(dx,e2y),MUL(dy,e2x)); \
+  V det = ADD(ADD(MUL(e1x,px),MUL(e1y,py)),MUL(e1z,pz)); \
+  /* tv = o - corner, beta = tv . p / det */ \
+  V tx = SUB(SET1(r.origin[0]),LOAD(&corner[0][i])); \
+  V ty = SUB(SET1(r.origin[1]),LOAD(&corner[1][i])); \
+  V tz = SUB(SET1(r.origin[2]),LOAD(&corner[2][i])); \
+  V beta = DIV(ADD(ADD(MUL(tx,px),MUL(ty,py)),MUL(tz,pz)),det); \
+  /* q = tv x e1, gamma = d . q / det */ \
+  V qx = SUB(MUL(ty,e1z),MUL(tz,e1y)); \
+  V qy = SUB(MUL(tz,e1x),MUL(tx,e1z)); \
+  V qz = SUB(MUL(tx,e1y),MUL(ty,e1x)); \
+  V gamma = DIV(ADD(ADD(MUL(dx,qx),MUL(dy,qy)),MUL(dz,qz)),det); \
+  V inside = AND(AND(GE(beta,SET1(-FILTER_TOLERANCE)),GE(gamma,SET1(-FILTER_TOLERANCE))), \
+                 LE(ADD(beta,gamma),SET1(1+FILTER_TOLERANCE))); \
+  V small = LT(ANDNOT(SET1(-0.0f),det),SET1(FILTER_DET_EPSILON)); \
+  unsigned int block_mask = MOVEMASK(OR(inside,small));
+
+#ifdef TRIANGLE_SIMD
+
+__attribute__((target("sse2")))
+unsigned int TriangleBuffer::FilterSSE(int first, const FloatRay &r) const {
+  unsigned int mask = 0;
+  for (int b = 0; b < TRIANGLE_BLOCK_SIZE; b += 4) {
+    int i = first + b;
+    FILTER_BODY(__m128, _mm_loadu_ps, _mm_set1_ps, _mm_add_ps, _mm_sub_ps, _mm_mul_ps, _mm_div_ps,
+                _mm_and_ps, _mm_andnot_ps, _mm_or_ps, _mm_cmplt_ps, _mm_cmpge_ps, _mm_cmple_ps,
+                _mm_movemask_ps);
+    mask |= block_mask << b;
+  }
+  return mask;
+}
+
+#define AVX_LT(a,b) _mm256_cmp_ps(a,b,_CMP_LT_OQ)
+#define AVX_GE(a,b) _mm256_cmp_ps(a,b,_CMP_GE_OQ)
+#define AVX_LE(a,b) _mm256_cmp_ps(a,b,_CMP_LE_OQ)
+
+__attribute__((target("avx2")))
+unsigned int TriangleBuffer::FilterAVX2(int first, const FloatRay &r) const {
+  int i = first;
+  FILTER_BODY(__m256, _mm256_loadu_ps, _mm256_set1_ps, _mm256_add_ps, _mm256_sub_ps, _mm256_mul_ps,
+              _mm256_div_ps, _mm256_and_ps, _mm256_andnot_ps, _mm256_or_ps, AVX_LT, AVX_GE, AVX_LE,
+              _mm256_movemask_ps);
+  return block_mask;
+}
+
+enum TRIANGLE_KERNEL TriangleBuffer::DetectKernel() {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return TRIANGLE_KERNEL_AVX2;
+  if (__builtin_cpu_supports("sse2")) return TRIANGLE_KERNEL_SSE;
+  return TRIANGLE_KERNEL_SCALAR;
+}
+
+#else
+
+// no SIMD: every triangle is a candidate
+unsigned int TriangleBuffer::FilterSSE(int first, const FloatRay &r) const { return ~0u; }
+unsigned int TriangleBuffer::FilterAVX2(int first, const FloatRay &r) const { return ~0u; }
+enum TRIANGLE_KERNEL TriangleBuffer::DetectKernel() { return TRIANGLE_KERNEL_SCALAR; }
+
+#endif
+
+bool TriangleBuffer::setKernel(enum TRIANGLE_KERNEL k) {
+  if (k > DetectKernel()) return false;
+  kernel = k;
+  return true;
+}
+
+// ====================================================================
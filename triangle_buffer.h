@@ -0,0 +1,111 @@
+#ifndef _TRIANGLE_BUFFER_H_
+#define _TRIANGLE_BUFFER_H_
+
+#include <vector>
+#include <cassert>
+#include "vectors.h"
+
+class Face;
+class Material;
+class Ray;
+class Hit;
+
+// ====================================================================
+// Flat, intersection-ready copy of the quads: each quad is split into
+// the two triangles (a,b,c) and (a,c,d) that Face::intersect tests,
+// and everything the intersection needs is precomputed and stored as
+// a structure of arrays (one array per component), so the ray caster
+// never walks the half-edge ring or recomputes a normal.
+//
+// The corner and the two edges of each triangle are floats (they only
+// feed the barycentric test).  The plane of the quad (the averaged
+// normal & the plane constant) stays in double, even in the single
+// precision build: the hit distance is compared against EPSILON to
+// avoid self intersection, and that needs the full precision of the
+// vertex positions.
+//
+// Filter tests one ray against a block of (up to) 8 consecutive
+// triangles at once with SSE or AVX2 (chosen at runtime, depending on
+// what the CPU supports).  It works in float with generous
+// tolerances, so it may report a triangle the ray misses but never
+// misses one it hits: the candidates are then confirmed with the exact
+// (scalar) Intersect.
+// ====================================================================
+
+// number of triangles tested by one call to Filter
+#define TRIANGLE_BLOCK_SIZE 8
+
+enum TRIANGLE_KERNEL { TRIANGLE_KERNEL_SCALAR, TRIANGLE_KERNEL_SSE, TRIANGLE_KERNEL_AVX2 };
+
+// single precision copy of a ray, made once per ray for the kernels
+class FloatRay {
+public:
+  FloatRay(const Ray &r);
+  float origin[3];
+  float direction[3];
+};
+
+class TriangleBuffer {
+
+public:
+
+  // CONSTRUCTOR
+  TriangleBuffer() { Pad(); }
+
+  // ACCESSORS
+  int numTriangles() const { return materials.size(); }
+  // the kernel used by Filter (by default the best one the CPU supports)
+  static enum TRIANGLE_KERNEL getKernel() { return kernel; }
+
+  // MODIFIERS
+  // append the two triangles of the quad, returns the index of the first
+  int AddQuad(const Face *f);
+
+  // intersect the ray with the triangle and, if it is closer than the
+  // current hit, update the hit (same result as Face::intersect)
+  bool Intersect(int i, const Ray &r, Hit &h, bool intersect_backfacing) const;
+  // bitmask of the triangles first..first+n-1 (n <= TRIANGLE_BLOCK_SIZE)
+  // that the ray may intersect (bit j for triangle first+j)
+  unsigned int Filter(int first, int n, const FloatRay &r) const {
+    assert (first >= 0 && n >= 0 && n <= TRIANGLE_BLOCK_SIZE && first+n <= numTriangles());
+    unsigned int all = (1u << n) - 1;
+    switch (kernel) {
+    case TRIANGLE_KERNEL_AVX2: return FilterAVX2(first,r) & all;
+    case TRIANGLE_KERNEL_SSE:  return FilterSSE(first,r) & all;
+    default:                   return all;
+    }
+  }
+  // (-triangle_kernel, for testing & benchmarking) use a different
+  // kernel, if the CPU supports it
+  static bool setKernel(enum TRIANGLE_KERNEL k);
+
+private:
+
+  // HELPER FUNCTIONS
+  // keep TRIANGLE_BLOCK_SIZE unused entries at the end of the float
+  // arrays, so the kernels can always load a whole block
+  void Pad();
+  void Unpad();
+  unsigned int FilterSSE(int first, const FloatRay &r) const;
+  unsigned int FilterAVX2(int first, const FloatRay &r) const;
+  static enum TRIANGLE_KERNEL DetectKernel();
+
+  // REPRESENTATION (one entry per triangle)
+  // the first corner and the edges to the other two corners
+  std::vector<float> corner[3];
+  std::vector<float> edge1[3];
+  std::vector<float> edge2[3];
+  // texture coordinates of the three corners
+  std::vector<float> s[3];
+  std::vector<float> t[3];
+  // plane of the quad: normal . p = d
+  std::vector<double> normal[3];
+  std::vector<double> d;
+  std::vector<Material*> materials;
+
+  static enum TRIANGLE_KERNEL kernel;
+};
+
+// ====================================================================
+
+#endif
@@ -2,11 +2,11 @@
 #define _UTILS_H
 
 #include <cmath>
+#include <cstddef>
+#include <new>
+#include <stdint.h>
 #include "vectors.h"
-#include "MersenneTwister.h"
-
-// a single random number generate for reproduceable randomness
-extern MTRand GLOBAL_mtrand;
+#include "sampler.h"
 
 // =========================================================================
 // EPSILON is a necessary evil for raytracing implementations
@@ -72,12 +72,12 @@ inline double AreaOfTriangle(const Vec3f &a, const Vec3f &b, const Vec3f &c) {
 }
 
 // utility function to generate random numbers used for sampling
-inline Vec3f RandomUnitVector() {
+inline Vec3f RandomUnitVector(Sampler &sampler) {
   Vec3f tmp;
   while (1) {
-    tmp = Vec3f(2*GLOBAL_mtrand.rand()-1,  // random real in [-1,1]
-		2*GLOBAL_mtrand.rand()-1,  // random real in [-1,1]
-		2*GLOBAL_mtrand.rand()-1); // random real in [-1,1]
+    tmp = Vec3f(2*sampler.rand()-1,  // random real in [-1,1]
+		2*sampler.rand()-1,  // random real in [-1,1]
+		2*sampler.rand()-1); // random real in [-1,1]
     if (tmp.Length() < 1) break;
   }
   tmp.Normalize();
@@ -93,11 +93,42 @@ inline Vec3f MirrorDirection(const Vec3f &normal, const Vec3f &incoming) {
 
 // compute a random diffuse direction
 // (not the same as a uniform random direction on the hemisphere)
-inline Vec3f RandomDiffuseDirection(const Vec3f &normal) {
-  Vec3f answer = normal+RandomUnitVector();
+inline Vec3f RandomDiffuseDirection(const Vec3f &normal, Sampler &sampler) {
+  Vec3f answer = normal+RandomUnitVector(sampler);
   answer.Normalize();
   return answer;
 }
 
+// =========================================================================
+// Data updated by several threads at once (e.g., a counter per
+// thread) is kept on cache lines of its own, so the cores don't
+// fight over a line they all write to (false sharing).
+
+#define CACHE_LINE_SIZE 64
+
+// std::allocator doesn't honor alignments beyond 16 bytes (before
+// C++17), so a vector of alignas(CACHE_LINE_SIZE) objects gets its
+// storage from this one: the block is allocated a cache line larger
+// and the start moved up to the next line (the block itself is
+// remembered just before it).
+template <class T> class CacheLineAllocator {
+public:
+  typedef T value_type;
+  CacheLineAllocator() {}
+  template <class U> CacheLineAllocator(const CacheLineAllocator<U>&) {}
+  T* allocate(size_t n) {
+    char *block = (char*)::operator new(n*sizeof(T) + sizeof(void*) + CACHE_LINE_SIZE-1);
+    uintptr_t start = (uintptr_t)(block + sizeof(void*));
+    start = (start + CACHE_LINE_SIZE-1) & ~(uintptr_t)(CACHE_LINE_SIZE-1);
+    ((void**)start)[-1] = block;
+    return (T*)start;
+  }
+  void deallocate(T *p, size_t) { ::operator delete(((void**)p)[-1]); }
+};
+template <class T, class U>
+bool operator==(const CacheLineAllocator<T>&, const CacheLineAllocator<U>&) { return true; }
+template <class T, class U>
+bool operator!=(const CacheLineAllocator<T>&, const CacheLineAllocator<U>&) { return false; }
+
 
 #endif
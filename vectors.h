@@ -14,22 +14,27 @@ class Matrix;
 // ====================================================================
 // ====================================================================
 
-class Vec3f {
+template <class T> class Vec3 {
 
 public:
 
   // -----------------------------------------------
   // CONSTRUCTORS, ASSIGNMENT OPERATOR, & DESTRUCTOR
-  Vec3f() { data[0] = data[1] = data[2] = 0; }
-  Vec3f(const Vec3f &V) {
+  Vec3() { data[0] = data[1] = data[2] = 0; }
+  Vec3(const Vec3 &V) {
     data[0] = V.data[0];
     data[1] = V.data[1];
     data[2] = V.data[2]; }
-  Vec3f(double d0, double d1, double d2) {
+  Vec3(T d0, T d1, T d2) {
     data[0] = d0;
     data[1] = d1;
     data[2] = d2; }
-  const Vec3f& operator=(const Vec3f &V) {
+  // conversion between precisions
+  template <class U> explicit Vec3(const Vec3<U> &V) {
+    data[0] = V[0];
+    data[1] = V[1];
+    data[2] = V[2]; }
+  const Vec3& operator=(const Vec3 &V) {
     data[0] = V.data[0];
     data[1] = V.data[1];
     data[2] = V.data[2];
@@ -37,103 +42,103 @@ public:
 
   // ----------------------------
   // SIMPLE ACCESSORS & MODIFIERS
-  double operator[](int i) const { 
+  T operator[](int i) const { 
     assert (i >= 0 && i < 3); 
     return data[i]; }
-  double x() const { return data[0]; }
-  double y() const { return data[1]; }
-  double z() const { return data[2]; }
-  double r() const { return data[0]; }
-  double g() const { return data[1]; }
-  double b() const { return data[2]; }
-  void setx(double x) { data[0]=x; }
-  void sety(double y) { data[1]=y; }
-  void setz(double z) { data[2]=z; }
-  void set(double d0, double d1, double d2) {
+  T x() const { return data[0]; }
+  T y() const { return data[1]; }
+  T z() const { return data[2]; }
+  T r() const { return data[0]; }
+  T g() const { return data[1]; }
+  T b() const { return data[2]; }
+  void setx(T x) { data[0]=x; }
+  void sety(T y) { data[1]=y; }
+  void setz(T z) { data[2]=z; }
+  void set(T d0, T d1, T d2) {
     data[0] = d0;
     data[1] = d1;
     data[2] = d2; }
 
   // ----------------
   // EQUALITY TESTING 
-  int operator==(const Vec3f &V) {
+  int operator==(const Vec3 &V) {
     return ((data[0] == V.data[0]) &&
 	    (data[1] == V.data[1]) &&
 	    (data[2] == V.data[2])); }
-  int operator!=(const Vec3f &V) {
+  int operator!=(const Vec3 &V) {
     return ((data[0] != V.data[0]) ||
 	    (data[1] != V.data[1]) ||
 	    (data[2] != V.data[2])); }
 
   // ------------------------
   // COMMON VECTOR OPERATIONS
-  double Length() const {
+  T Length() const {
     return sqrt(data[0]*data[0]+data[1]*data[1]+data[2]*data[2]); }
-    double Length2() const {
+    T Length2() const {
         return data[0]*data[0]+data[1]*data[1]+data[2]*data[2]; }
   void Normalize() {
-    double length = Length();
+    T length = Length();
     if (length > 0) { Scale (1/length); } }
-  void Scale(double d) { Scale(d,d,d); }
-  void Scale(double d0, double d1, double d2) {
+  void Scale(T d) { Scale(d,d,d); }
+  void Scale(T d0, T d1, T d2) {
     data[0] *= d0;
     data[1] *= d1;
     data[2] *= d2; }
   void Negate() { Scale(-1.0); }
-  inline double average() {
+  inline T average() const {
 	return (data[0] + data[1] + data[2]) / 3.0;
   }
-  double Dot3(const Vec3f &V) const {
+  T Dot3(const Vec3 &V) const {
     return data[0] * V.data[0] +
       data[1] * V.data[1] +
       data[2] * V.data[2] ; }
-  static void Cross3(Vec3f &c, const Vec3f &v1, const Vec3f &v2) {
-    double x = v1.data[1]*v2.data[2] - v1.data[2]*v2.data[1];
-    double y = v1.data[2]*v2.data[0] - v1.data[0]*v2.data[2];
-    double z = v1.data[0]*v2.data[1] - v1.data[1]*v2.data[0];
+  static void Cross3(Vec3 &c, const Vec3 &v1, const Vec3 &v2) {
+    T x = v1.data[1]*v2.data[2] - v1.data[2]*v2.data[1];
+    T y = v1.data[2]*v2.data[0] - v1.data[0]*v2.data[2];
+    T z = v1.data[0]*v2.data[1] - v1.data[1]*v2.data[0];
     c.data[0] = x; c.data[1] = y; c.data[2] = z; }
 
   // ---------------------
   // VECTOR MATH OPERATORS
-  Vec3f& operator+=(const Vec3f &V) {
+  Vec3& operator+=(const Vec3 &V) {
     data[0] += V.data[0];
     data[1] += V.data[1];
     data[2] += V.data[2];
     return *this; }
-  Vec3f& operator-=(const Vec3f &V) {
+  Vec3& operator-=(const Vec3 &V) {
     data[0] -= V.data[0];
     data[1] -= V.data[1];
     data[2] -= V.data[2];
     return *this; }
-  Vec3f& operator*=(double d) {
+  Vec3& operator*=(T d) {
     data[0] *= d;
     data[1] *= d;
     data[2] *= d;
     return *this; }
-  Vec3f& operator/=(double d) {
+  Vec3& operator/=(T d) {
     data[0] /= d;
     data[1] /= d;
     data[2] /= d;
     return *this; }  
-  friend Vec3f operator+(const Vec3f &v1, const Vec3f &v2) { 
-    Vec3f v3 = v1; v3 += v2; return v3; }
-  friend Vec3f operator-(const Vec3f &v1) {
-    Vec3f v2 = v1; v2.Negate(); return v2; }
-  friend Vec3f operator-(const Vec3f &v1, const Vec3f &v2) {
-    Vec3f v3 = v1; v3 -= v2; return v3; }
-  friend Vec3f operator*(const Vec3f &v1, double d) {
-    Vec3f v2 = v1; v2.Scale(d); return v2; }
-  friend Vec3f operator*(const Vec3f &v1, const Vec3f &v2) {
-    Vec3f v3 = v1; v3.Scale(v2.x(),v2.y(),v2.z()); return v3; }
-  friend Vec3f operator*(double d, const Vec3f &v1) {
+  friend Vec3 operator+(const Vec3 &v1, const Vec3 &v2) { 
+    Vec3 v3 = v1; v3 += v2; return v3; }
+  friend Vec3 operator-(const Vec3 &v1) {
+    Vec3 v2 = v1; v2.Negate(); return v2; }
+  friend Vec3 operator-(const Vec3 &v1, const Vec3 &v2) {
+    Vec3 v3 = v1; v3 -= v2; return v3; }
+  friend Vec3 operator*(const Vec3 &v1, T d) {
+    Vec3 v2 = v1; v2.Scale(d); return v2; }
+  friend Vec3 operator*(const Vec3 &v1, const Vec3 &v2) {
+    Vec3 v3 = v1; v3.Scale(v2.x(),v2.y(),v2.z()); return v3; }
+  friend Vec3 operator*(T d, const Vec3 &v1) {
     return v1 * d; }
 
   // --------------
   // INPUT / OUTPUT
-  friend std::ostream& operator<< (std::ostream &ostr, const Vec3f &v) {
+  friend std::ostream& operator<< (std::ostream &ostr, const Vec3 &v) {
     ostr << v.data[0] << " " << v.data[1] << " " << v.data[2] << std::endl; 
     return ostr; }
-  friend std::istream& operator>> (std::istream &istr, Vec3f &v) {
+  friend std::istream& operator>> (std::istream &istr, Vec3 &v) {
     istr >> v.data[0] >> v.data[1] >> v.data[2];
     return istr; }
   
@@ -142,10 +147,26 @@ private:
   friend class Matrix;
 
   // REPRESENTATION
-  double		data[3];
+  T		data[3];
   
 };
 
+// the general purpose vector (positions, normals, colors & energies)
+typedef Vec3<double> Vec3f;
+
+// The precision of the geometry in the hot loops of ray casting and
+// the photon map: the bounds & slab test of the BVH nodes and the
+// kdtree distances.  Build with "make PRECISION=float" for single
+// precision (half the memory traffic, twice the SIMD lanes).  Rays,
+// hits, the triangle planes & the exact intersection tests, and the
+// accumulation of colors & energies always stay in double.
+#ifdef SINGLE_PRECISION
+typedef float real;
+#else
+typedef double real;
+#endif
+typedef Vec3<real> Vec3r;
+
 // ====================================================================
 // ====================================================================
 